@@ -18,12 +18,11 @@
 */
 #include <stdlib.h>
 #include <stdio.h>
-#include <memory.h>
+#include <string.h>
 #include <limits.h>
 #include "mtap.h"
 
-#pragma pack (1)
-static tap_image_t tap_header = {
+static const tap_image_t tap_header = {
 	{ 'C','1','6','-','T','A','P','E','-','R','A','W' },
 	2,
 	C264,
@@ -31,129 +30,498 @@ static tap_image_t tap_header = {
 	0,
 	0
 };
-#pragma pack()
 
-double tap_frequencies[] = {
+static const unsigned int tap_frequencies[] = {
 	C64PALFREQ, C64NTSCFREQ, VICPALFREQ, VICNTSCFREQ, C16PALFREQ, C16NTSCFREQ
 };
 
-static double tap_frequency;
-static FILE* tapfile = NULL;
-static unsigned int pulsestat[256];
-static unsigned int pulsecount;
-static char tapname[PATH_MAX];
-static unsigned int chunks = 0;
+/* TAP units per second for a machine and video standard */
+unsigned int mtap_get_frequency(unsigned int machine, unsigned int video_standard)
+{
+	if (machine > C264)
+		machine = C64;
+	return tap_frequencies[machine * 2 + (video_standard == NTSC ? 1 : 0)];
+}
+
+static int create_file(mtap_writer_t* tw, const char* filename, int noow)
+{
+	FILE* fp;
+
+	if (!filename) {
+		tw->inmemory = 1;
+		tw->outlen = 0;
+		return 0;
+	}
+	if (noow && (fp = fopen(filename, "rb"))) {
+		fclose(fp);
+		return 3;
+	}
+	tw->tapfile = fopen(filename, "wb");
+	if (!tw->tapfile)
+		return 1;
+	if (!fwrite(&tw->header, MTAP_HEADER_LEN, 1, tw->tapfile)) {
+		fclose(tw->tapfile);
+		tw->tapfile = NULL;
+		return 2;
+	}
+	tw->outlen = 0;
+	return 0;
+}
 
 /* create tap file and return 0 on success */
 /* 1 : error creating file */
 /* 2 : error writing header */
 /* 3 : file already exist */
-int mtap_create(const char* filename, int noow)
+int mtap_create(mtap_writer_t* tw, const char* filename, int noow, unsigned int samplerate)
 {
-	if (tapfile = fopen(filename, "wb")) {
-		fclose(tapfile);
-		if (noow)
-			return 1;
-	}
-	tapfile = fopen(filename, "wb");
-	if (!tapfile)
-		return 1;
-	if (!fwrite(&tap_header, sizeof(tap_header), 1, tapfile))
+	int r;
+
+	memset(tw, 0, sizeof(*tw));
+	tw->header = tap_header;
+	tw->header.data = NULL;
+	if (filename)
+		strncpy(tw->tapname, filename, sizeof(tw->tapname) - 1);
+	tw->outbuf = malloc(TAP_OUTBUF_SIZE);
+	if (!tw->outbuf)
 		return 1;
-	tap_frequency = tap_frequencies[tap_header.machine * 2 + tap_header.video_standard];
-	pulsecount = 0;
-	// empty pulse statistics
-	memset(pulsestat, 0, sizeof(pulsestat));
+	if ((r = create_file(tw, filename, noow)) != 0) {
+		free(tw->outbuf);
+		tw->outbuf = NULL;
+		return r;
+	}
+	tw->tap_frequency = mtap_get_frequency(tw->header.machine, tw->header.video_standard);
+	tw->samplerate = samplerate;
 	return 0;
 }
 
-int mtap_new_chunk(unsigned int cnt)
+void mtap_set_format(mtap_writer_t* tw, unsigned int version, unsigned int machine, unsigned int video_standard)
+{
+	tw->header.version = version;
+	tw->header.machine = machine;
+	tw->header.video_standard = video_standard;
+	tw->tap_frequency = mtap_get_frequency(machine, video_standard);
+}
+
+/* append the buffered pulses to the data kept in memory */
+static void keep_pulses(mtap_writer_t* tw)
+{
+	if (tw->memlen + tw->outlen > tw->memsize) {
+		size_t size = tw->memsize ? tw->memsize : TAP_OUTBUF_SIZE;
+		unsigned char* data;
+
+		while (size < tw->memlen + tw->outlen)
+			size *= 2;
+		if ((data = realloc(tw->memdata, size)) == NULL) {
+			tw->memfailed = 1;
+			return;
+		}
+		tw->memdata = data;
+		tw->memsize = size;
+	}
+	memcpy(tw->memdata + tw->memlen, tw->outbuf, tw->outlen);
+	tw->memlen += tw->outlen;
+}
+
+static void flush_pulses(mtap_writer_t* tw)
+{
+	if (tw->outlen && tw->inmemory) {
+		keep_pulses(tw);
+		tw->outlen = 0;
+	}
+	else if (tw->outlen) {
+		int stage = mtstats_enter(tw->stats, MTSTATS_WRITE);
+
+		fwrite(tw->outbuf, 1, tw->outlen, tw->tapfile);
+		if (tw->stats)
+			tw->stats->bytes_out += tw->outlen;
+		tw->outlen = 0;
+		mtstats_leave(tw->stats, stage);
+	}
+}
+
+/* finish file by adding data length */
+static void finish_file(mtap_writer_t* tw)
 {
-	char newname[PATH_MAX];
-	char* name = strrchr(tapname, '.');
+	if (tw->inmemory) {
+		flush_pulses(tw);
+		tw->header.size = (unsigned int)tw->memlen;
+		return;
+	}
+	if (!tw->tapfile)
+		return;
+	flush_pulses(tw);
+	tw->header.size = ftell(tw->tapfile) - MTAP_HEADER_LEN;
+	fseek(tw->tapfile, 0, SEEK_SET);
+	fwrite(&tw->header, MTAP_HEADER_LEN, 1, tw->tapfile);
+	fclose(tw->tapfile);
+	tw->tapfile = NULL;
+}
+
+/* continue in a new numbered file */
+static int new_chunk(mtap_writer_t* tw)
+{
+	char basename[PATH_MAX];
+	char newname[PATH_MAX + 8];
+	char* ext;
 
-	*name = '\0';
-	sprintf(newname, "%s%03u.tap", name, cnt);
+	finish_file(tw);
+	tw->chunks++;
+	strcpy(basename, tw->tapname);
+	if ((ext = strrchr(basename, '.')) != NULL)
+		*ext = '\0';
+	sprintf(newname, "%s%03u.tap", basename, tw->chunks);
 
-	return mtap_create(newname, 1);
+	return create_file(tw, newname, 1);
 }
 
-void mtap_close()
+void mtap_statistics(const mtap_writer_t* tw, FILE* out)
 {
-	const unsigned int divisor = tap_header.version > 1 ? 2 : 1;
+	const unsigned int divisor = tw->header.version > 1 ? 2 : 1;
 	const unsigned int pulse_len_limit = 0xD0 / divisor; // longest regular pulse
 	unsigned int i, j = 0, maxpulslen = 0;
 
 	// count pulses shorter than ~$CD (longest full wave pulse)
 	for (i = 0; i < pulse_len_limit; i++)
-		if (pulsestat[i]) {
-			j += pulsestat[i];
+		if (tw->pulsestat[i]) {
+			j += tw->pulsestat[i];
 			// remember highest count pulse for display
-			if (maxpulslen < pulsestat[i])
-				maxpulslen = pulsestat[i];
+			if (maxpulslen < tw->pulsestat[i])
+				maxpulslen = tw->pulsestat[i];
 		}
-	fprintf(stderr, "Converted tape length %1.1f minutes.\n", (double)pulsecount / tap_frequency / 60.0);
-	fprintf(stderr, "Number of unique pulse lengths < $%02X : %u\n", pulse_len_limit, j);
+	fprintf(out, "Converted tape length %1.1f minutes.\n", (double)tw->pulsecount / tw->tap_frequency / 60.0);
+	fprintf(out, "Number of unique pulse lengths < $%02X : %u\n", pulse_len_limit, j);
 
 	for (i = 0; i < 0x50; i++)
-		if (pulsestat[i]) {
-			fprintf(stderr, "  $%02X : %-12u", i, pulsestat[i]);
-			unsigned int k = pulsestat[i] * 50 / maxpulslen;
+		if (tw->pulsestat[i]) {
+			fprintf(out, "  $%02X : %-12u", i, tw->pulsestat[i]);
+			unsigned int k = tw->pulsestat[i] * 50 / maxpulslen;
 			while (k--) {
-				fprintf(stderr, ".");
+				fprintf(out, ".");
 			};
-			fprintf(stderr, "\n");
+			fprintf(out, "\n");
 		}
-	if (!tapfile)
-		return;
-	// finish file by adding data length
-	tap_header.size = ftell(tapfile) - MTAP_HEADER_LEN;
-	fseek(tapfile, 0, SEEK_SET);
-	fwrite(&tap_header, MTAP_HEADER_LEN, 1, tapfile);
-	// close
-	fclose(tapfile);
 }
 
-double mtap_write_pulse(double length, int split)
+/*
+	How sharply the pulses cluster: the pulses in the three strongest
+	histogram peaks (+-1) less all other pulses, so that a detector that
+	splits or merges pulses scores lower than one that finds more of them
+	at the expected widths. Very short pulses are noise, never a peak.
+*/
+unsigned int mtap_histogram_score(const mtap_writer_t* tw)
 {
-	unsigned int i;
+	unsigned char used[256];
+	unsigned int i, p, best, bestcount, inpeaks = 0, total = 0;
+
+	memset(used, 0, sizeof(used));
+	for (p = 0; p < 3; p++) {
+		best = bestcount = 0;
+		for (i = 8; i < 256; i++)
+			if (!used[i] && tw->pulsestat[i] > bestcount) {
+				best = i;
+				bestcount = tw->pulsestat[i];
+			}
+		if (!best)
+			break;
+		for (i = best - 1; i <= best + 1 && i < 256; i++)
+			if (!used[i]) {
+				inpeaks += tw->pulsestat[i];
+				used[i] = 1;
+			}
+		// neighbours of a peak are not peaks of their own
+		used[best - 2] = 1;
+		if (best + 2 < 256)
+			used[best + 2] = 1;
+	}
+	// long pulses and pauses (00) are not counted either way
+	for (i = 1; i < 256; i++)
+		total += tw->pulsestat[i];
+	return inpeaks > total - inpeaks ? inpeaks - (total - inpeaks) : 0;
+}
+
+int mtap_save(mtap_writer_t* tw, const char* filename, int noow)
+{
+	int r, stage;
 
-	if (!tapfile)
+	if (!tw->inmemory)
 		return 1;
+	finish_file(tw);
+	if (tw->memfailed)
+		return 4;
+	if ((r = create_file(tw, filename, noow)) != 0)
+		return r;
+	stage = mtstats_enter(tw->stats, MTSTATS_WRITE);
+	if (fwrite(tw->memdata, 1, tw->memlen, tw->tapfile) != tw->memlen)
+		r = 2;
+	if (tw->stats)
+		tw->stats->bytes_out += tw->memlen;
+	mtstats_leave(tw->stats, stage);
+	fclose(tw->tapfile);
+	tw->tapfile = NULL;
+	strncpy(tw->tapname, filename, sizeof(tw->tapname) - 1);
+	tw->inmemory = 0;
+	free(tw->memdata);
+	tw->memdata = NULL;
+	return r;
+}
+
+void mtap_close(mtap_writer_t* tw)
+{
+	finish_file(tw);
+	free(tw->outbuf);
+	tw->outbuf = NULL;
+	free(tw->memdata);
+	tw->memdata = NULL;
+}
 
-	// 'length' is in seconds
-	// convert to TAP units
-	unsigned int len8 = (unsigned long)(length * tap_frequency + 0.5);
-	double remainder = length - len8 / tap_frequency;
+void mtap_write_pulses(mtap_writer_t* tw, const unsigned int* lengths, size_t count, int split)
+{
+	// 'lengths' are in samples, convert to TAP units (8 cycles) with exact
+	// integer arithmetic; the rounding error is carried over to the next
+	// pulse so the TAP timeline never drifts from the WAV timeline
+	const long long samplerate = tw->samplerate;
+	const long long clock = (long long)tw->tap_frequency * 8;
+	const long long unit = 8 * samplerate;
+	unsigned char* outbuf = tw->outbuf;
+	size_t outlen = tw->outlen;
+	size_t n;
+	unsigned int i;
+	int stage;
 
-	pulsecount += len8;
+	if (!tw->tapfile && !tw->inmemory)
+		return;
+	stage = mtstats_enter(tw->stats, MTSTATS_ENCODE);
+	if (tw->stats)
+		tw->stats->pulses += count;
 
-	// long pulse?
-	if (len8 > 255) {
+	for (n = 0; n < count; n++) {
+		const long long cycles = (long long)lengths[n] * clock + tw->pulse_error;
+		unsigned int len8 = (unsigned int)((cycles + unit / 2) / unit);
 
-		unsigned int longpulse = len8;
+		// long pulse?
+		if (len8 > 255 && tw->header.version == 0) {
+			// v0 has no pause lengths, a 00 byte stands for about 1/50 s;
+			// a rounding error that large is not carried over to a pulse
+			const long long zero = (long long)MTAP_V0_PAUSE(tw->tap_frequency) * samplerate;
+			unsigned int zeros = (unsigned int)((cycles + zero / 2) / zero);
 
-		do {
-			// write pilot byte
-			fputc(0, tapfile);
-			// write length
-			for (i = 0; i < 3; i++) {
-				fputc(longpulse & 0xFF, tapfile);
-				longpulse >>= 8;
+			if (!zeros)
+				zeros = 1;
+			tw->pulse_error = 0;
+			tw->pulsecount += zeros * (MTAP_V0_PAUSE(tw->tap_frequency) / 8);
+			while (zeros--) {
+				if (outlen == TAP_OUTBUF_SIZE) {
+					tw->outlen = outlen;
+					flush_pulses(tw);
+					outlen = 0;
+				}
+				outbuf[outlen++] = 0;
 			}
-			if (longpulse && split) {
-				mtap_close();
-				chunks++;
-				mtap_new_chunk(chunks);
+			len8 = 0;
+		}
+		else if (len8 > 255) {
+			// long pulses are stored in cycles
+			unsigned int longpulse = (unsigned int)((cycles + samplerate / 2) / samplerate);
+
+			tw->pulse_error = cycles - longpulse * samplerate;
+			tw->pulsecount += (longpulse + 4) / 8;
+			do {
+				unsigned int chunk = longpulse > 0xFFFFFF ? 0xFFFFFF : longpulse;
+
+				longpulse -= chunk;
+				if (outlen + 4 > TAP_OUTBUF_SIZE) {
+					tw->outlen = outlen;
+					flush_pulses(tw);
+					outlen = 0;
+				}
+				// write pilot byte
+				outbuf[outlen++] = 0;
+				// write length
+				for (i = 0; i < 3; i++) {
+					outbuf[outlen++] = chunk & 0xFF;
+					chunk >>= 8;
+				}
+				if (longpulse && split && !tw->inmemory) {
+					tw->outlen = outlen;
+					if (new_chunk(tw)) {
+						mtstats_leave(tw->stats, stage);
+						return;
+					}
+					outlen = 0;
+				}
+			} while (longpulse);
+			// count as 'zero' for the pulse statistics
+			len8 = 0;
+		}
+		else {
+			// 00 would start a long pulse
+			if (!len8)
+				len8 = 1;
+			tw->pulse_error = cycles - len8 * unit;
+			tw->pulsecount += len8;
+			if (outlen == TAP_OUTBUF_SIZE) {
+				tw->outlen = outlen;
+				flush_pulses(tw);
+				outlen = 0;
 			}
-		} while (longpulse);
-		// count as 'zero' for the pulse statistics
-		len8 = 0;
+			outbuf[outlen++] = (unsigned char)len8;
+		}
+
+		tw->pulsestat[len8]++;
 	}
+	tw->outlen = outlen;
+	mtstats_leave(tw->stats, stage);
+}
+
+void mtap_write_pulse(mtap_writer_t* tw, unsigned int length, int split)
+{
+	mtap_write_pulses(tw, &length, 1, split);
+}
+
+/* move the unconsumed data to the start of the buffer and read more */
+static size_t fill_input(mtap_reader_t* tr)
+{
+	size_t n = tr->inlen - tr->inpos;
+	size_t readn = TAP_INBUF_SIZE - n;
+	int stage = mtstats_enter(tr->stats, MTSTATS_READ);
+
+	memmove(tr->inbuf, tr->inbuf + tr->inpos, n);
+	tr->inpos = 0;
+	if (readn > tr->remaining)
+		readn = tr->remaining;
+	readn = fread(tr->inbuf + n, 1, readn, tr->tapfile);
+	// a short read ends the data
+	tr->remaining = readn ? tr->remaining - (unsigned int)readn : 0;
+	tr->inlen = n + readn;
+	if (tr->stats)
+		tr->stats->bytes_in += readn;
+	mtstats_leave(tr->stats, stage);
+	return tr->inlen;
+}
+
+int mtap_parse_header(const void* data, size_t len, tap_image_t* header)
+{
+	if (len < MTAP_HEADER_LEN)
+		return 2;
+	memcpy(header, data, MTAP_HEADER_LEN);
+	header->data = NULL;
+	if (strncmp(header->header_string + 4, "TAPE-RAW", 8) != 0)
+		return 2;
+	if (header->version > 2)
+		return 3;
+	return 0;
+}
+
+int mtap_open(mtap_reader_t* tr, const char* filename)
+{
+	unsigned char raw[MTAP_HEADER_LEN];
+	long filelength;
+	int r;
+
+	memset(tr, 0, sizeof(*tr));
+	if ((tr->tapfile = fopen(filename, "rb")) == NULL)
+		return 1;
+	fseek(tr->tapfile, 0, SEEK_END);
+	filelength = ftell(tr->tapfile);
+	rewind(tr->tapfile);
+	if (filelength < MTAP_HEADER_LEN || fread(raw, MTAP_HEADER_LEN, 1, tr->tapfile) != 1)
+		r = 2;
 	else
-		fputc(len8, tapfile);
+		r = mtap_parse_header(raw, MTAP_HEADER_LEN, &tr->header);
+	if (r) {
+		mtap_close_reader(tr);
+		return r;
+	}
+	if ((tr->inbuf = malloc(TAP_INBUF_SIZE)) == NULL) {
+		mtap_close_reader(tr);
+		return 4;
+	}
+	tr->tap_frequency = mtap_get_frequency(tr->header.machine, tr->header.video_standard);
+	tr->datasize = (unsigned int)(filelength - MTAP_HEADER_LEN);
+	tr->remaining = tr->datasize;
+	return 0;
+}
 
-	pulsestat[len8]++;
+int mtap_rewind(mtap_reader_t* tr)
+{
+	if (fseek(tr->tapfile, MTAP_HEADER_LEN, SEEK_SET))
+		return 1;
+	tr->remaining = tr->datasize;
+	tr->position = 0;
+	tr->inpos = tr->inlen = 0;
+	return 0;
+}
+
+const unsigned char* mtap_read_block(mtap_reader_t* tr, size_t* len)
+{
+	if (tr->inpos == tr->inlen && !fill_input(tr))
+		return NULL;
+	*len = tr->inlen - tr->inpos;
+	tr->position += (unsigned int)*len;
+	tr->inpos = tr->inlen;
+	return tr->inbuf;
+}
 
-	return remainder;
+size_t mtap_read_pulses(mtap_reader_t* tr, mtap_pulse_t* pulses, size_t max)
+{
+	const unsigned char* in = tr->inbuf;
+	size_t pos = tr->inpos;
+	size_t n = 0;
+
+	while (n < max) {
+		unsigned char c;
+
+		// keep a whole long pulse in the buffer
+		if (tr->inlen - pos < 4 && tr->remaining) {
+			tr->position += (unsigned int)(pos - tr->inpos);
+			tr->inpos = pos;
+			fill_input(tr);
+			pos = 0;
+		}
+		if (pos == tr->inlen)
+			break;
+		c = in[pos++];
+		if (c) {
+			pulses[n].value = c;
+			pulses[n++].length = 0;
+		}
+		else if (tr->header.version == 0) {
+			// a run of 00 bytes is one pause, possibly spanning chunks
+			unsigned int zeros = 1;
+
+			for (;;) {
+				while (pos < tr->inlen && in[pos] == 0) {
+					pos++;
+					zeros++;
+				}
+				if (pos < tr->inlen || !tr->remaining)
+					break;
+				tr->position += (unsigned int)(pos - tr->inpos);
+				tr->inpos = pos;
+				fill_input(tr);
+				pos = 0;
+			}
+			pulses[n].value = 0;
+			pulses[n++].length = zeros;
+		}
+		else if (tr->inlen - pos >= 3) {
+			// 00 and the length in cycles, 24-bit little endian
+			pulses[n].value = 0;
+			pulses[n++].length = in[pos] | (in[pos + 1] << 8) | (in[pos + 2] << 16);
+			pos += 3;
+		}
+		// the 00 of a truncated long pulse at the very end is skipped
+	}
+	tr->position += (unsigned int)(pos - tr->inpos);
+	tr->inpos = pos;
+	return n;
+}
+
+void mtap_close_reader(mtap_reader_t* tr)
+{
+	if (tr->tapfile)
+		fclose(tr->tapfile);
+	tr->tapfile = NULL;
+	free(tr->inbuf);
+	tr->inbuf = NULL;
 }
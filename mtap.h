@@ -1,5 +1,10 @@
 #pragma once
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "mtstats.h"
+
 #ifndef PATH_MAX
 #define PATH_MAX _MAX_PATH
 #endif
@@ -41,7 +46,82 @@ typedef struct _TAP_HEADER
 #pragma pack(pop)
 
 #define MTAP_HEADER_LEN (20) /* 20 - TAP format header length */
+/* a v0 00 byte has no length of its own, it stands for about 1/50 s; */
+/* in cycles, for the TAP unit frequency of a machine */
+#define MTAP_V0_PAUSE(tap_frequency) ((tap_frequency) * 8 / 50)
+#define TAP_OUTBUF_SIZE (1 << 20) /* encoded pulses are written in blocks of this size */
+#define TAP_INBUF_SIZE (1 << 16) /* TAP data is read in chunks of this size */
+
+/* TAP writer state */
+typedef struct {
+	tap_image_t header;
+	FILE* tapfile;
+	unsigned int tap_frequency;
+	unsigned int samplerate;
+	long long pulse_error;	/* rounding error carried to the next pulse, in 1/samplerate cycles */
+	unsigned char* outbuf;	/* encoded pulses not yet written */
+	size_t outlen;
+	unsigned int pulsestat[256];
+	unsigned int pulsecount;
+	char tapname[PATH_MAX];
+	unsigned int chunks;
+	mtstats_t* stats;		/* counters and timers, NULL: none */
+	int inmemory;			/* no file yet, the data is kept for mtap_save */
+	unsigned char* memdata;
+	size_t memlen, memsize;
+	int memfailed;			/* some data did not fit in memory */
+} mtap_writer_t;
+
+extern unsigned int mtap_get_frequency(unsigned int machine, unsigned int video_standard);
+/* filename NULL keeps the TAP in memory until mtap_save */
+extern int mtap_create(mtap_writer_t* tw, const char* filename, int noow, unsigned int samplerate);
+/* write a TAP kept in memory to a file, returns 0 or an mtap_create error, */
+/* 4 if it ran out of memory */
+extern int mtap_save(mtap_writer_t* tw, const char* filename, int noow);
+/* change the TAP version and machine of a file before writing pulses; */
+/* pulses are half waves in v2 and full waves in v0 and v1 */
+extern void mtap_set_format(mtap_writer_t* tw, unsigned int version, unsigned int machine, unsigned int video_standard);
+extern void mtap_write_pulse(mtap_writer_t* tw, unsigned int length, int split);
+/* write a batch of pulses, lengths in samples */
+extern void mtap_write_pulses(mtap_writer_t* tw, const unsigned int* lengths, size_t count, int split);
+/* print the pulse histogram */
+extern void mtap_statistics(const mtap_writer_t* tw, FILE* out);
+/* how cleanly the pulses cluster: pulses in the histogram peaks less those outside */
+extern unsigned int mtap_histogram_score(const mtap_writer_t* tw);
+extern void mtap_close(mtap_writer_t* tw);
+
+/* one TAP pulse */
+typedef struct {
+	unsigned char value;	/* TAP byte, 0 for a pause */
+	unsigned int length;	/* pause length: cycles (v1, v2) or number of 00 bytes (v0) */
+} mtap_pulse_t;
+
+/* TAP reader state */
+typedef struct {
+	tap_image_t header;		/* size as stored in the file */
+	FILE* tapfile;
+	unsigned int tap_frequency;
+	unsigned int datasize;	/* actual data length */
+	unsigned int remaining;	/* data bytes not yet read from the file */
+	unsigned int position;	/* data bytes consumed */
+	unsigned char* inbuf;	/* data read but not yet consumed */
+	size_t inpos, inlen;
+	mtstats_t* stats;		/* counters and timers, NULL: none */
+} mtap_reader_t;
 
-extern int mtap_create(const char* filename, int noow);
-extern double mtap_write_pulse(double length, int split);
-extern void mtap_close();
+/* check the header at the start of a TAP image in memory and copy it, */
+/* returns 0 on success, 2 or 3 as mtap_open */
+extern int mtap_parse_header(const void* data, size_t len, tap_image_t* header);
+/* open tap file and return 0 on success */
+/* 1 : error opening file */
+/* 2 : not a TAP file */
+/* 3 : unsupported TAP version */
+/* 4 : out of memory */
+extern int mtap_open(mtap_reader_t* tr, const char* filename);
+/* decode up to max pulses, returns 0 at the end of the data */
+extern size_t mtap_read_pulses(mtap_reader_t* tr, mtap_pulse_t* pulses, size_t max);
+/* next chunk of raw data bytes, NULL at the end of the data */
+extern const unsigned char* mtap_read_block(mtap_reader_t* tr, size_t* len);
+/* restart from the first data byte */
+extern int mtap_rewind(mtap_reader_t* tr);
+extern void mtap_close_reader(mtap_reader_t* tr);
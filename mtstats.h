@@ -0,0 +1,150 @@
+/*
+	mtstats.h
+	(c) 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#pragma once
+
+/* Per-stage timers and counters of a conversion */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Stages; the time of a run is always charged to exactly one of them */
+enum {
+	MTSTATS_OTHER = 0,	// setup and anything not below
+	MTSTATS_HEADER,		// file header parsing and sizing
+	MTSTATS_READ,		// input I/O and sample format conversion
+	MTSTATS_DETECT,		// filtering and pulse detection
+	MTSTATS_ENCODE,		// pulse encoding and rendering
+	MTSTATS_WRITE,		// output I/O
+	MTSTATS_STAGES
+};
+
+typedef struct {
+	double				seconds[MTSTATS_STAGES];
+	unsigned long long	calls[MTSTATS_STAGES];
+	int					stage;			// the stage being timed
+	double				since;			// when it was entered
+	double				start;
+	unsigned long long	bytes_in, bytes_out;
+	unsigned long long	samples, pulses;
+	long long			buffers;		// bytes of working buffers allocated
+	long long			peak_buffers;
+} mtstats_t;
+
+/* Monotonic time in seconds */
+static __inline double mtstats_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER c, f;
+
+	QueryPerformanceCounter(&c);
+	QueryPerformanceFrequency(&f);
+	return (double)c.QuadPart / f.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static __inline void mtstats_init(mtstats_t* s)
+{
+	memset(s, 0, sizeof(*s));
+	s->start = s->since = mtstats_now();
+}
+
+/* Charge the time so far to the current stage and switch to another one */
+static __inline int mtstats_switch(mtstats_t* s, int stage)
+{
+	double now = mtstats_now();
+	int prev = s->stage;
+
+	s->seconds[prev] += now - s->since;
+	s->since = now;
+	s->stage = stage;
+	return prev;
+}
+
+/* Enter a stage; returns the previous one, to leave to after a nested */
+/* stage. s may be NULL. */
+static __inline int mtstats_enter(mtstats_t* s, int stage)
+{
+	if (!s)
+		return MTSTATS_OTHER;
+	s->calls[stage]++;
+	return mtstats_switch(s, stage);
+}
+
+static __inline void mtstats_leave(mtstats_t* s, int prev)
+{
+	if (s)
+		mtstats_switch(s, prev);
+}
+
+/* A working buffer of 'bytes' allocated, or freed if negative */
+static __inline void mtstats_buffer(mtstats_t* s, long long bytes)
+{
+	s->buffers += bytes;
+	if (s->buffers > s->peak_buffers)
+		s->peak_buffers = s->buffers;
+}
+
+static __inline void mtstats_json_string(FILE* out, const char* str)
+{
+	fputc('"', out);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fputc('\\', out);
+		if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+/* Print the report as one JSON object */
+static __inline void mtstats_json(mtstats_t* s, FILE* out, const char* tool, const char* input, const char* output)
+{
+	static const char* names[MTSTATS_STAGES] = { "other", "header", "read", "detect", "encode", "write" };
+	double total;
+	int k;
+
+	mtstats_switch(s, s->stage);
+	total = s->since - s->start;
+	fprintf(out, "{ \"tool\": \"%s\", \"input\": ", tool);
+	mtstats_json_string(out, input);
+	fprintf(out, ", \"output\": ");
+	mtstats_json_string(out, output);
+	fprintf(out, ",\n");
+	fprintf(out, "  \"wall_s\": %.6f,\n  \"stages\": {", total);
+	for (k = 0; k < MTSTATS_STAGES; k++)
+		fprintf(out, "%s\n    \"%s\": { \"s\": %.6f, \"calls\": %llu }", k ? "," : "", names[k], s->seconds[k], s->calls[k]);
+	fprintf(out, "\n  },\n  \"bytes_in\": %llu, \"bytes_out\": %llu, \"samples\": %llu, \"pulses\": %llu,\n",
+		s->bytes_in, s->bytes_out, s->samples, s->pulses);
+	fprintf(out, "  \"peak_buffer_bytes\": %lld,\n", s->peak_buffers);
+	fprintf(out, "  \"samples_per_s\": %.0f, \"pulses_per_s\": %.0f }\n",
+		total > 0 ? s->samples / total : 0, total > 0 ? s->pulses / total : 0);
+}
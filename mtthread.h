@@ -0,0 +1,85 @@
+/*
+	mtthread.h
+	(c) 2016, 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#pragma once
+
+/* Minimal thread wrappers for Win32 and POSIX threads */
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+
+typedef HANDLE mtthread_t;
+#define MTTHREAD_FUNC(name) unsigned __stdcall name(void* arg)
+#define MTTHREAD_RETURN return 0
+
+static __inline int mtthread_create(mtthread_t* t, unsigned(__stdcall* fn)(void*), void* arg)
+{
+	*t = (HANDLE)_beginthreadex(NULL, 0, fn, arg, 0, NULL);
+	return *t ? 0 : 1;
+}
+
+static __inline void mtthread_join(mtthread_t t)
+{
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+static __inline unsigned int mtthread_cpus(void)
+{
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors ? si.dwNumberOfProcessors : 1;
+}
+
+/* Atomic increment, returns the value before */
+static __inline long mtthread_next(volatile long* counter)
+{
+	return InterlockedIncrement(counter) - 1;
+}
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t mtthread_t;
+#define MTTHREAD_FUNC(name) void* name(void* arg)
+#define MTTHREAD_RETURN return NULL
+
+static inline int mtthread_create(mtthread_t* t, void* (*fn)(void*), void* arg)
+{
+	return pthread_create(t, NULL, fn, arg);
+}
+
+static inline void mtthread_join(mtthread_t t)
+{
+	pthread_join(t, NULL);
+}
+
+static inline unsigned int mtthread_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? (unsigned int)n : 1;
+}
+
+static inline long mtthread_next(volatile long* counter)
+{
+	return __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+#endif
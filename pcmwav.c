@@ -16,98 +16,189 @@
 	along with this program; if not, write to the Free Software
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
+#include <string.h>
+#include <limits.h>
+#include <math.h>
 #include "pcmwav.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if !defined(PCMWAV_NOSIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PCMWAV_SSE2
+#include <emmintrin.h>
+#endif
+
+// Skips n bytes forward, by reading if the input cannot seek
+static int skip_bytes(pcmwavfile* pwf, unsigned int n)
+{
+	char scratch[4096];
+
+	if (pwf->seekable)
+		return fseek(pwf->winfile, n, SEEK_CUR) == 0;
+	while (n) {
+		size_t k = n < sizeof(scratch) ? n : sizeof(scratch);
 
-char pcmwav_error[256];
+		if (fread(scratch, 1, k, pwf->winfile) != k)
+			return 0;
+		n -= (unsigned int)k;
+	}
+	return 1;
+}
 
 int pcmwav_open(const char* fname, const char* access, pcmwavfile* opwf)
 {
 	RIFFhdr		rhdr;
 	fmt_sub		fmt;
+	fmt_ext		ext;
 	size_t		nread;
 	char		have_fmt = 0;
 	unsigned int	subchunk, subchunk_size;
-
-	opwf->winfile = fopen(fname, access);
+	unsigned int	pos;
+
+	opwf->mapbase = NULL;
+	opwf->mapsize = 0;
+	if (!strcmp(fname, "-")) {
+		// standard input: parsed strictly forward, its length is not known
+		opwf->winfile = stdin;
+		opwf->seekable = 0;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	}
+	else {
+		opwf->winfile = fopen(fname, access);
+		opwf->seekable = 1;
+	}
 	if (opwf->winfile == 0) {
-		sprintf(pcmwav_error, "Cannot open file \"%s\".\n", fname);
+		sprintf(opwf->error, "Cannot open file \"%s\".\n", fname);
 		return 0;
 	}
-	fseek(opwf->winfile, 0, SEEK_END);
-	opwf->filesize = ftell(opwf->winfile);
-	fseek(opwf->winfile, 0, SEEK_SET);
+	opwf->filesize = 0;
+	if (opwf->seekable) {
+		fseek(opwf->winfile, 0, SEEK_END);
+		opwf->filesize = ftell(opwf->winfile);
+		fseek(opwf->winfile, 0, SEEK_SET);
+	}
 
 	// Read RIFF header
 	nread = fread(&rhdr, 1, sizeof(rhdr), opwf->winfile);
-	if (!nread) {
-		sprintf(pcmwav_error, "Error reading RIFF header (%x).\n", ferror(opwf->winfile));
-		fclose(opwf->winfile);
+	if (nread != sizeof(rhdr)) {
+		sprintf(opwf->error, "Error reading RIFF header (%x).\n", ferror(opwf->winfile));
+		pcmwav_close(opwf);
 		return 0;
 	}
+	pos = sizeof(rhdr);
 
 	// Check it
 	if ((rhdr.ChunkID != 0x46464952 /* 'RIFF' */) || (rhdr.Format != 0x45564157 /* 'WAVE' */)) {
-		sprintf(pcmwav_error, "This is not a PCM WAV file.\n");
-		fclose(opwf->winfile);
+		sprintf(opwf->error, "This is not a PCM WAV file.\n");
+		pcmwav_close(opwf);
 		return 0;
 	}
 
-	/* read subchunks until we encounter 'data' */
+	/* read subchunks until we encounter 'data', never seeking backwards */
 	do {
 		// Read subchunk ID
-		if (!fread(&subchunk, 1, sizeof(subchunk), opwf->winfile)) {
-			sprintf(pcmwav_error, "Read error: this is not a correct PCM WAV file.\n");
-			fclose(opwf->winfile);
+		if (fread(&subchunk, 1, sizeof(subchunk), opwf->winfile) != sizeof(subchunk)) {
+			sprintf(opwf->error, "Read error: this is not a correct PCM WAV file.\n");
+			pcmwav_close(opwf);
 			return 0;
 		}
+		pos += sizeof(subchunk);
 
 		if (subchunk == 0x20746D66 /* 'fmt ' */) {
-			opwf->formatpos = ftell(opwf->winfile);
+			opwf->formatpos = pos;
 			// Read subchunk 1
 			nread = fread(&fmt, 1, sizeof(fmt), opwf->winfile);
+			pos += (unsigned int)nread;
 
-			// Check it
-			if (fmt.AudioFormat != 1) {
-				sprintf(pcmwav_error, "Error in format subchunk: this is not a PCM WAV file.\n");
-				fclose(opwf->winfile);
+			if (nread != sizeof(fmt)) {
+				sprintf(opwf->error, "Error in format subchunk: this is not a PCM WAV file.\n");
+				pcmwav_close(opwf);
 				return 0;
 			}
+			subchunk_size = fmt.Subchunk1Size > 16 ? fmt.Subchunk1Size - 16 + (fmt.Subchunk1Size & 1) : 0;
+
+			// the extensible format keeps the actual format code in its subformat
+			opwf->format = fmt.AudioFormat;
+			if (fmt.AudioFormat == PCMWAV_FORMAT_EXTENSIBLE && subchunk_size >= sizeof(ext)) {
+				nread = fread(&ext, 1, sizeof(ext), opwf->winfile);
+				pos += (unsigned int)nread;
+				subchunk_size -= (unsigned int)nread;
+				opwf->format = (nread == sizeof(ext)) ? ext.SubFormat : 0;
+			}
 
+			// Check it
 			opwf->bitspersample = fmt.BitsPerSample;
-
-			if ((opwf->bitspersample != 1) && (opwf->bitspersample != 8) && (opwf->bitspersample != 16)) {
-				sprintf(pcmwav_error, "Can only deal with 1-bit, 8-bit or 16-bit samples.\n");
-				fclose(opwf->winfile);
+			if (opwf->format == PCMWAV_FORMAT_FLOAT) {
+				if (opwf->bitspersample != 32) {
+					sprintf(opwf->error, "Can only deal with 32-bit float samples.\n");
+					pcmwav_close(opwf);
+					return 0;
+				}
+			}
+			else if (opwf->format != PCMWAV_FORMAT_PCM) {
+				sprintf(opwf->error, "Error in format subchunk: this is not a PCM WAV file.\n");
+				pcmwav_close(opwf);
+				return 0;
+			}
+			else if ((opwf->bitspersample != 1) && (opwf->bitspersample != 8) && (opwf->bitspersample != 16)
+				&& (opwf->bitspersample != 24) && (opwf->bitspersample != 32)) {
+				sprintf(opwf->error, "Can only deal with 1-bit, 8-bit, 16-bit, 24-bit or 32-bit samples.\n");
+				pcmwav_close(opwf);
 				return 0;
 			}
 
 			// Skip any extra header bytes
-			if (fmt.Subchunk1Size - 16)
-				fseek(opwf->winfile, fmt.Subchunk1Size - 16, SEEK_CUR);
+			if (subchunk_size) {
+				skip_bytes(opwf, subchunk_size);
+				pos += subchunk_size;
+			}
 
 			have_fmt = 1;
 		}
 		else if (subchunk != 0x61746164 /* 'data' */) {
-			// unknown subchunk - read size and skip
-			nread = fread(&subchunk_size, 1, sizeof(subchunk_size), opwf->winfile);
-			fseek(opwf->winfile, subchunk_size, SEEK_CUR);
+			// unknown subchunk - read size and skip, with the pad byte of odd sizes
+			if (fread(&subchunk_size, 1, sizeof(subchunk_size), opwf->winfile) != sizeof(subchunk_size)
+				|| !skip_bytes(opwf, subchunk_size + (subchunk_size & 1))) {
+				sprintf(opwf->error, "Read error: this is not a correct PCM WAV file.\n");
+				pcmwav_close(opwf);
+				return 0;
+			}
+			pos += sizeof(subchunk_size) + subchunk_size + (subchunk_size & 1);
 		}
 
 	} while (subchunk != 0x61746164 /* 'data' */);
 
-	opwf->datasizepos = ftell(opwf->winfile);
+	opwf->datasizepos = pos;
 	if (!have_fmt) {
-		sprintf(pcmwav_error, "Encountered data subchunk, but no format subchunk found.\n");
-		fclose(opwf->winfile);
+		sprintf(opwf->error, "Encountered data subchunk, but no format subchunk found.\n");
+		pcmwav_close(opwf);
 		return 0;
 	}
 
 	/* read data chunk size */
 	nread = fread(&opwf->ndatabytes, 1, sizeof(opwf->ndatabytes), opwf->winfile);
+	pos += sizeof(opwf->ndatabytes);
 
 	opwf->samplerate = fmt.SampleRate;
 	opwf->nchannels = fmt.NumChannels;
-	opwf->datapos = ftell(opwf->winfile);
+	opwf->datapos = pos;
+
+	if (opwf->seekable) {
+		// truncated captures: only use the data actually present
+		if (opwf->datapos + (size_t)opwf->ndatabytes > opwf->filesize)
+			opwf->ndatabytes = opwf->filesize - opwf->datapos;
+	}
+	else if (opwf->ndatabytes == 0) {
+		// a capture still in progress, read up to the end of the stream
+		opwf->ndatabytes = UINT_MAX;
+	}
 
 	return 1;
 }
@@ -119,7 +210,7 @@ int pcmwav_read(pcmwavfile* pwf, void* buf, size_t len)
 	nread = fread(buf, 1, len, pwf->winfile);
 
 	if (nread != len) {
-		sprintf(pcmwav_error, "Error in pcmwav_read(); only read %zu instead of %zu bytes.",
+		sprintf(pwf->error, "Error in pcmwav_read(); only read %zu instead of %zu bytes.",
 			nread, len);
 		return 0;
 	}
@@ -127,6 +218,16 @@ int pcmwav_read(pcmwavfile* pwf, void* buf, size_t len)
 	return 1;
 }
 
+size_t pcmwav_read_upto(pcmwavfile* pwf, void* buf, size_t len)
+{
+	size_t nread = fread(buf, 1, len, pwf->winfile);
+
+	if (nread != len && ferror(pwf->winfile))
+		sprintf(pwf->error, "Error in pcmwav_read_upto(); only read %zu instead of %zu bytes.",
+			nread, len);
+	return nread;
+}
+
 int pcmwav_write(pcmwavfile* pwf, void* buf, size_t len)
 {
 	size_t nwritten;
@@ -134,7 +235,7 @@ int pcmwav_write(pcmwavfile* pwf, void* buf, size_t len)
 	nwritten = fread(buf, 1, len, pwf->winfile);
 
 	if (nwritten != len) {
-		sprintf(pcmwav_error, "Error in pcmwav_write(); only wrote %zu instead of %zu bytes.",
+		sprintf(pwf->error, "Error in pcmwav_write(); only wrote %zu instead of %zu bytes.",
 			nwritten, len);
 		return 0;
 	}
@@ -145,7 +246,7 @@ int pcmwav_write(pcmwavfile* pwf, void* buf, size_t len)
 int pcmwav_rewind(pcmwavfile* pwf)
 {
 	if (fseek(pwf->winfile, pwf->datapos, SEEK_SET)) {
-		sprintf(pcmwav_error, "Error in pcmwav_rewind().");
+		sprintf(pwf->error, "Error in pcmwav_rewind().");
 		return 0;
 	}
 
@@ -155,15 +256,186 @@ int pcmwav_rewind(pcmwavfile* pwf)
 int pcmwav_seek(pcmwavfile* pwf, size_t pos)
 {
 	if (fseek(pwf->winfile, pos, SEEK_CUR)) {
-		sprintf(pcmwav_error, "Error in pcmwav_seek() - pos = %zu", pos);
+		sprintf(pwf->error, "Error in pcmwav_seek() - pos = %zu", pos);
 		return 0;
 	}
 
 	return 1;
 }
 
+const unsigned char* pcmwav_map(pcmwavfile* pwf, size_t* len)
+{
+	size_t avail;
+
+	if (!pwf->mapbase) {
+		if (!pwf->seekable || pwf->filesize <= pwf->datapos)
+			return NULL;
+#ifdef _WIN32
+		HANDLE hmap = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(pwf->winfile)), NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!hmap)
+			return NULL;
+		pwf->mapbase = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+		// the view keeps the mapping object alive
+		CloseHandle(hmap);
+		if (!pwf->mapbase)
+			return NULL;
+#else
+		void* base = mmap(NULL, pwf->filesize, PROT_READ, MAP_SHARED, fileno(pwf->winfile), 0);
+		if (base == MAP_FAILED)
+			return NULL;
+		// samples are consumed front to back, so let the kernel read ahead aggressively
+		madvise(base, pwf->filesize, MADV_SEQUENTIAL);
+		pwf->mapbase = base;
+#endif
+		pwf->mapsize = pwf->filesize;
+	}
+	avail = pwf->mapsize - pwf->datapos;
+	*len = pwf->ndatabytes < avail ? pwf->ndatabytes : avail;
+
+	return (const unsigned char*)pwf->mapbase + pwf->datapos;
+}
+
 int pcmwav_close(pcmwavfile* pwf)
 {
-	fclose(pwf->winfile);
+	if (pwf->mapbase) {
+#ifdef _WIN32
+		UnmapViewOfFile(pwf->mapbase);
+#else
+		munmap(pwf->mapbase, pwf->mapsize);
+#endif
+		pwf->mapbase = NULL;
+	}
+	if (pwf->winfile != stdin)
+		fclose(pwf->winfile);
+	pwf->winfile = NULL;
 	return 1;
 }
+
+static short float_to_s16(float x)
+{
+	float v = x * 32768.0f;
+
+	// saturate like the vector path; NaN ends up at the bottom
+	if (!(v >= -32768.0f))
+		v = -32768.0f;
+	if (v > 32767.0f)
+		v = 32767.0f;
+	return (short)lrintf(v);
+}
+
+void pcmwav_convert(const pcmwavfile* pwf, const unsigned char* src, size_t n, short* dst)
+{
+	size_t i = 0;
+
+	if (pwf->format == PCMWAV_FORMAT_FLOAT) {
+#ifdef PCMWAV_SSE2
+		const __m128 scale = _mm_set1_ps(32768.0f), lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+
+		for (; i + 8 <= n; i += 8) {
+			// max/min return the second operand for NaN
+			__m128 a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float*)(src + 4 * i)), scale), lo), hi);
+			__m128 b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float*)(src + 4 * i + 16)), scale), lo), hi);
+
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+		}
+#endif
+		for (; i < n; i++) {
+			float x;
+
+			memcpy(&x, src + 4 * i, sizeof(x));
+			dst[i] = float_to_s16(x);
+		}
+		return;
+	}
+
+	switch (pwf->bitspersample) {
+	case 8:
+#ifdef PCMWAV_SSE2
+		{
+			// the sample becomes the high byte, 0x80 the low byte
+			const __m128i mid = _mm_set1_epi8((char)0x80);
+
+			for (; i + 16 <= n; i += 16) {
+				const __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)), mid);
+
+				_mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi8(mid, x));
+				_mm_storeu_si128((__m128i*)(dst + i + 8), _mm_unpackhi_epi8(mid, x));
+			}
+		}
+#endif
+		for (; i < n; i++)
+			dst[i] = (short)(((src[i] ^ 0x80) << 8) | 0x80);
+		break;
+	case 16:
+		memcpy(dst, src, n * sizeof(short));
+		break;
+	case 24:
+		// packed 3 byte samples, keep the upper two
+#ifdef PCMWAV_SSE2
+		// 4 samples of a 16-byte load: byte shifts put each one at the
+		// bottom of a dword, the second load needs 2 more samples in src
+		for (; i + 10 <= n; i += 8) {
+			const __m128i x = _mm_loadu_si128((const __m128i*)(src + 3 * i));
+			const __m128i y = _mm_loadu_si128((const __m128i*)(src + 3 * i + 12));
+			__m128i a = _mm_unpacklo_epi64(_mm_unpacklo_epi32(x, _mm_srli_si128(x, 3)),
+				_mm_unpacklo_epi32(_mm_srli_si128(x, 6), _mm_srli_si128(x, 9)));
+			__m128i b = _mm_unpacklo_epi64(_mm_unpacklo_epi32(y, _mm_srli_si128(y, 3)),
+				_mm_unpacklo_epi32(_mm_srli_si128(y, 6), _mm_srli_si128(y, 9)));
+
+			a = _mm_srai_epi32(_mm_slli_epi32(a, 8), 16);
+			b = _mm_srai_epi32(_mm_slli_epi32(b, 8), 16);
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+		}
+#endif
+		for (; i < n; i++)
+			dst[i] = (short)(src[3 * i + 1] | (src[3 * i + 2] << 8));
+		break;
+	case 32:
+#ifdef PCMWAV_SSE2
+		for (; i + 8 <= n; i += 8) {
+			const __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(src + 4 * i)), 16);
+			const __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(src + 4 * i + 16)), 16);
+
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(a, b));
+		}
+#endif
+		for (; i < n; i++)
+			dst[i] = (short)(src[4 * i + 2] | (src[4 * i + 3] << 8));
+		break;
+	}
+}
+
+void pcmwav_deinterleave(const unsigned char* src, size_t nframes, unsigned int nchannels,
+	unsigned int bytespersample, unsigned char** dst)
+{
+	size_t i = 0;
+	unsigned int c;
+
+#ifdef PCMWAV_SSE2
+	// stereo: split even and odd samples with shifts and packs; wav2tap
+	// converts every format to 16 bits first, so only that case is vectorized
+	if (nchannels == 2 && bytespersample == 2) {
+		for (; i + 8 <= nframes; i += 8) {
+			const __m128i a = _mm_loadu_si128((const __m128i*)(src + 4 * i));
+			const __m128i b = _mm_loadu_si128((const __m128i*)(src + 4 * i + 16));
+			const __m128i la = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+			const __m128i lb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+
+			_mm_storeu_si128((__m128i*)(dst[0] + 2 * i), _mm_packs_epi32(la, lb));
+			_mm_storeu_si128((__m128i*)(dst[1] + 2 * i), _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+		}
+	}
+#endif
+	if (bytespersample == 1) {
+		for (; i < nframes; i++)
+			for (c = 0; c < nchannels; c++)
+				dst[c][i] = src[i * nchannels + c];
+	}
+	else {
+		for (; i < nframes; i++)
+			for (c = 0; c < nchannels; c++) {
+				dst[c][2 * i] = src[(i * nchannels + c) * 2];
+				dst[c][2 * i + 1] = src[(i * nchannels + c) * 2 + 1];
+			}
+	}
+}
@@ -36,11 +36,27 @@ typedef struct {
 	unsigned short	BitsPerSample;
 } fmt_sub;
 
+/* WAVE_FORMAT_EXTENSIBLE part of the format subchunk */
+typedef struct {
+	unsigned short	cbSize;			// 22
+	unsigned short	ValidBitsPerSample;
+	unsigned int	ChannelMask;
+	unsigned short	SubFormat;		// format code, the first word of the subformat GUID
+	unsigned char	SubFormatGUID[14];
+} fmt_ext;
+
+/* Sample formats */
+#define PCMWAV_FORMAT_PCM			1
+#define PCMWAV_FORMAT_FLOAT			3
+#define PCMWAV_FORMAT_EXTENSIBLE	0xFFFE
+
 typedef struct {
 	unsigned short	nchannels;		// number of channels
 	unsigned int	samplerate;		// sampling rate (e.g. 44100)
-	unsigned int	bitspersample;	// bits per sample (8, 16)
-	unsigned int	ndatabytes;		// number of data bytes in wave file
+	unsigned int	bitspersample;	// bits per sample (1, 8, 16, 24, 32)
+	unsigned int	format;			// PCMWAV_FORMAT_PCM or PCMWAV_FORMAT_FLOAT (32 bits)
+	unsigned int	ndatabytes;		// number of data bytes in wave file (UINT_MAX: until the end of the stream)
+	int				seekable;		// 0 for standard input
 
 	// private variables
 	FILE* winfile;		// file handle
@@ -48,20 +64,27 @@ typedef struct {
 	unsigned int	datapos;
 	unsigned int	datasizepos;
 	unsigned int	filesize;
+	void*			mapbase;	// read-only mapping of the whole file, if any
+	size_t			mapsize;
+
+	char			error[256];	// On error: contains a string that describes the error
 } pcmwavfile;
 
 #pragma pack(pop)
 
-extern char pcmwav_error[];	// On error: contains a string that describes the error
-
 // Opens a PCM WAV file and fills opwf with info; returns 1
-// if successful or 0 on error
+// if successful or 0 on error. A file name of "-" reads standard
+// input; the headers are then parsed without seeking.
 // access = GENERIC_READ or GENERIC_WRITE (or both)
 int pcmwav_open(const char* fname, const char* access, pcmwavfile* opwf);
 
 // Reads len data bytes (not samples!) into buf
 int pcmwav_read(pcmwavfile* pwf, void* buf, size_t len);
 
+// Reads up to len data bytes into buf, returns the number read;
+// less than len at the end of the data
+size_t pcmwav_read_upto(pcmwavfile* pwf, void* buf, size_t len);
+
 // Writes len data bytes from buf
 int pcmwav_write(pcmwavfile* pwf, void* buf, size_t len);
 
@@ -71,5 +94,20 @@ int pcmwav_rewind(pcmwavfile* pwf);
 // Seeks +/- pos in file
 int pcmwav_seek(pcmwavfile* pwf, size_t pos);
 
+// Maps the file read-only into memory and returns a pointer to the first
+// data byte, storing the number of available data bytes in len;
+// returns NULL if the file cannot be mapped (use pcmwav_read() then)
+const unsigned char* pcmwav_map(pcmwavfile* pwf, size_t* len);
+
+// Converts n samples of the file's format (8 bits or more) from src to
+// signed 16-bit samples in dst. 8-bit samples land in the middle of their
+// 16-bit step, so that every 8-bit level is symmetric around zero.
+void pcmwav_convert(const pcmwavfile* pwf, const unsigned char* src, size_t n, short* dst);
+
+// Splits nframes interleaved frames of 8-bit or 16-bit samples into one
+// buffer per channel
+void pcmwav_deinterleave(const unsigned char* src, size_t nframes, unsigned int nchannels,
+	unsigned int bytespersample, unsigned char** dst);
+
 // Closes PCM WAV file
 int pcmwav_close(pcmwavfile* pwf);
@@ -0,0 +1,924 @@
+/*
+	pulsedec.c
+	(c) 2016, 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "pulsedec.h"
+#include "mtthread.h"
+
+#if !defined(PULSEDEC_NOSIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PULSEDEC_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define PULSEDEC_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static __inline unsigned int ctz64(uint64_t x)
+{
+	unsigned long i;
+	_BitScanForward64(&i, x);
+	return i;
+}
+#else
+#define ctz64(x) ((unsigned int)__builtin_ctzll(x))
+#endif
+
+/*
+	Samples are signed 16-bit. The levels and thresholds are given on the
+	8-bit scale of the original detectors: LEVEL8 is where an 8-bit level
+	lies among the 16-bit samples (see pcmwav_convert()) and STEP8 is the
+	size of one 8-bit step, so 8-bit input decodes exactly as it always has.
+*/
+#define STEP8			256
+#define LEVEL8(x)		(((x) - 0x80) * STEP8 + 0x80)
+
+/*
+	Every kernel is generated from one template function per detector
+	family: the method and the input polarity are compile time constants
+	of each instance, so the sample loop carries no dispatch and no
+	per-sample threshold arithmetic. select_kernel() picks the instance
+	from the tables at the end once, when the decoder is set up.
+*/
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TEMPLATE static __forceinline
+#else
+#define TEMPLATE static inline __attribute__((always_inline))
+#endif
+
+typedef size_t (*kernel_t)(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses);
+
+// Detector limits on the 16-bit scale, derived from the threshold once per run
+typedef struct {
+	int		high, low;		// level window: set above high, reset at or below low
+	int		diff;			// minimum change to toggle
+	int		swing;			// minimum distance of a local max and min
+} limits_t;
+
+TEMPLATE limits_t get_limits(const pulsedec_t* dec)
+{
+	const int m = (128 * dec->threshold) / 100;
+	limits_t lim;
+
+	lim.high = LEVEL8(0x80 + m);
+	lim.low = LEVEL8(0x7F - m);
+	lim.diff = dec->threshold * STEP8;
+	lim.swing = (dec->threshold * 240) / 255 * STEP8;
+	return lim;
+}
+
+TEMPLATE int fetch_sample(const short* data, size_t i, const int invert)
+{
+	return invert ? ~data[i] : data[i];
+}
+
+// in: wave sample; updates the decoded bit
+TEMPLATE void decode_sample(pulsedec_t* dec, int sample, const limits_t* lim, const unsigned int method)
+{
+	int change = sample - dec->previous_sample;
+
+	switch (method) {
+	default:
+	case PULSEDEC_COMBINED:
+		if (sample > lim->high && (change >= 8 * STEP8)) {
+			dec->bit = 1;
+		}
+		else if (sample <= lim->low && (change <= -8 * STEP8)) {
+			dec->bit = 0;
+		}
+		break;
+	case PULSEDEC_HYSTERESIS:
+		if (sample > lim->high) {
+			dec->bit = 1;
+		}
+		else if (sample <= lim->low) {
+			dec->bit = 0;
+		}
+		break;
+	case PULSEDEC_DIFFERENCE:
+		if (abs(change) > lim->diff)
+			dec->bit ^= 1;
+		break;
+	case PULSEDEC_ZEROCROSS:
+		if (((dec->previous_sample > LEVEL8(0x80) && sample <= LEVEL8(0x7F))
+			|| (sample > LEVEL8(0x80) && dec->previous_sample <= LEVEL8(0x7F)))
+			&& abs(change) > lim->diff)
+			dec->bit ^= 1;
+		break;
+	case PULSEDEC_EDGE:
+		if (change <= 0 && dec->previous_change > 0) {
+			// new local high
+			dec->lastMax = sample;
+			if ((dec->lastMax - dec->lastMin) > lim->swing) {
+				dec->bit = 0x10;
+			}
+		}
+		else if (change >= 0 && dec->previous_change < 0) {
+			// new local low
+			dec->lastMin = sample;
+			if ((dec->lastMax - dec->lastMin) > lim->swing) {
+				dec->bit = 0x00;
+			}
+		}
+		break;
+	}
+	dec->previous_change = change;
+	dec->previous_sample = sample;
+}
+
+TEMPLATE size_t run_scalar(pulsedec_t* dec, const short* data, size_t nsamples, unsigned int* pulses,
+	const unsigned int method, const int invert)
+{
+	const limits_t lim = get_limits(dec);
+	pulsedec_t d = *dec;	// a local copy lives in registers
+	size_t i, np = 0;
+
+	for (i = 0; i < nsamples; i++) {
+		decode_sample(&d, fetch_sample(data, i, invert), &lim, method);
+
+		if (d.prevbit ^ d.bit) {
+			pulses[np++] = d.pulselen;
+			d.prevbit = d.bit;
+			d.pulselen = 0;
+		}
+		d.pulselen++;
+	}
+	*dec = d;
+	return np;
+}
+
+/*
+	1-bit input: 64 samples per machine word. Each byte holds 8 samples,
+	MSB first, so the bits are first reversed within every byte to put
+	sample k at bit k. XOR-ing the word with itself shifted by one sample
+	leaves exactly the edges set, and count-trailing-zeros jumps from one
+	edge to the next.
+*/
+static inline uint64_t reverse_byte_bits(uint64_t x)
+{
+	x = ((x >> 1) & 0x5555555555555555ull) | ((x & 0x5555555555555555ull) << 1);
+	x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+	x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+	return x;
+}
+
+TEMPLATE size_t run_1bit(pulsedec_t* dec, const unsigned char* data, size_t nsamples, unsigned int* pulses,
+	const int invert)
+{
+	const uint64_t inv = invert ? ~(uint64_t)0 : 0;
+	const size_t nwords = nsamples / 64;
+	ptrdiff_t last = -(ptrdiff_t)dec->pulselen;
+	uint64_t prev = dec->prevbit, w, edges;
+	size_t i, np = 0;
+
+	for (i = 0; i < nwords; i++) {
+		memcpy(&w, data + i * 8, sizeof(w));
+		w = reverse_byte_bits(w) ^ inv;
+		edges = w ^ ((w << 1) | prev);
+		prev = w >> 63;
+		while (edges) {
+			ptrdiff_t pos = (ptrdiff_t)(i * 64 + ctz64(edges));
+
+			pulses[np++] = (unsigned int)(pos - last);
+			last = pos;
+			edges &= edges - 1;
+		}
+	}
+	dec->bit = dec->prevbit = (unsigned char)prev;
+	dec->pulselen = (unsigned int)((ptrdiff_t)(nwords * 64) - last);
+
+	// remaining samples one bit at a time
+	for (i = nwords * 64; i < nsamples; i++) {
+		dec->bit = ((data[i >> 3] >> (7 - (i & 7))) ^ (unsigned char)inv) & 1;
+		if (dec->prevbit ^ dec->bit) {
+			pulses[np++] = dec->pulselen;
+			dec->prevbit = dec->bit;
+			dec->pulselen = 0;
+		}
+		dec->pulselen++;
+	}
+	return np;
+}
+
+#ifdef PULSEDEC_SSE2
+
+/*
+	The vector kernels turn 64 samples at a time into transition bitmasks
+	and then hop from one transition to the next with count-trailing-zeros,
+	so the per-sample work is a handful of compares.
+	'last' is the position of the previous transition relative to the
+	current block (negative if it happened in an earlier block).
+*/
+
+// Hysteresis: 'set' marks samples above, 'reset' samples below the window
+static inline size_t walk_hysteresis(pulsedec_t* dec, uint64_t set, uint64_t reset, ptrdiff_t base,
+	ptrdiff_t* last, unsigned int* pulses, size_t np)
+{
+	uint64_t events = dec->bit ? reset : set;
+
+	while (events) {
+		unsigned int k = ctz64(events);
+		ptrdiff_t pos = base + k;
+
+		pulses[np++] = (unsigned int)(pos - *last);
+		*last = pos;
+		dec->bit ^= 1;
+		if (k == 63)
+			break;
+		events = (dec->bit ? reset : set) & (~(uint64_t)0 << (k + 1));
+	}
+	return np;
+}
+
+// Zero crossing: every marked sample toggles the level
+static inline size_t walk_toggles(pulsedec_t* dec, uint64_t toggles, ptrdiff_t base,
+	ptrdiff_t* last, unsigned int* pulses, size_t np)
+{
+	while (toggles) {
+		ptrdiff_t pos = base + ctz64(toggles);
+
+		pulses[np++] = (unsigned int)(pos - *last);
+		*last = pos;
+		dec->bit ^= 1;
+		toggles &= toggles - 1;
+	}
+	return np;
+}
+
+// Bring the scalar history up to date after a vectorized stretch ending at 'i'
+TEMPLATE void finish_vector(pulsedec_t* dec, const short* data, size_t i, ptrdiff_t last, const int invert)
+{
+	const int s1 = fetch_sample(data, i - 1, invert);
+
+	dec->previous_change = (i >= 2) ? s1 - fetch_sample(data, i - 2, invert) : s1 - dec->previous_sample;
+	dec->previous_sample = s1;
+	dec->prevbit = dec->bit;
+	dec->pulselen = (unsigned int)((ptrdiff_t)i - last);
+}
+
+// Hysteresis window limits, clamped to the sample range; a limit outside
+// of it can never be passed
+TEMPLATE void hysteresis_window(const pulsedec_t* dec, int* hi, int* lo, uint64_t* set_en, uint64_t* reset_en)
+{
+	const limits_t lim = get_limits(dec);
+
+	*hi = lim.high;
+	*lo = lim.low;
+	*set_en = *hi < SHRT_MAX ? ~(uint64_t)0 : 0;
+	*reset_en = *lo >= SHRT_MIN ? ~(uint64_t)0 : 0;
+	if (*hi > SHRT_MAX)
+		*hi = SHRT_MAX;
+	if (*lo < SHRT_MIN)
+		*lo = SHRT_MIN;
+}
+
+/* 16 samples in two vectors */
+TEMPLATE void sse2_s16_load(const short* p, __m128i* lo, __m128i* hi, const int invert)
+{
+	*lo = _mm_loadu_si128((const __m128i*)p);
+	*hi = _mm_loadu_si128((const __m128i*)(p + 8));
+	if (invert) {
+		*lo = _mm_xor_si128(*lo, _mm_set1_epi16(-1));
+		*hi = _mm_xor_si128(*hi, _mm_set1_epi16(-1));
+	}
+}
+
+static inline unsigned int sse2_mask16(__m128i lo, __m128i hi)
+{
+	return (unsigned int)_mm_movemask_epi8(_mm_packs_epi16(lo, hi));
+}
+
+TEMPLATE size_t run_hysteresis_sse2(pulsedec_t* dec, const short* data, size_t nsamples, unsigned int* pulses,
+	const int invert)
+{
+	ptrdiff_t last = -(ptrdiff_t)dec->pulselen;
+	size_t i = 0, np = 0;
+	uint64_t set_en, reset_en;
+	int hi, lo;
+
+	hysteresis_window(dec, &hi, &lo, &set_en, &reset_en);
+	{
+		const __m128i vhi = _mm_set1_epi16((short)hi), vlo = _mm_set1_epi16((short)lo);
+
+		for (; i + 64 <= nsamples; i += 64) {
+			uint64_t set = 0, reset = 0;
+			unsigned int g;
+
+			for (g = 0; g < 64; g += 16) {
+				__m128i s0, s1;
+				sse2_s16_load(data + i + g, &s0, &s1, invert);
+				set |= (uint64_t)sse2_mask16(_mm_cmpgt_epi16(s0, vhi), _mm_cmpgt_epi16(s1, vhi)) << g;
+				reset |= (uint64_t)(~sse2_mask16(_mm_cmpgt_epi16(s0, vlo), _mm_cmpgt_epi16(s1, vlo)) & 0xFFFF) << g;
+			}
+			np = walk_hysteresis(dec, set & set_en, reset & reset_en, i, &last, pulses, np);
+		}
+	}
+	if (i)
+		finish_vector(dec, data, i, last, invert);
+	return np + run_scalar(dec, data + i, nsamples - i, pulses + np, PULSEDEC_HYSTERESIS, invert);
+}
+
+TEMPLATE size_t run_zerocross_sse2(pulsedec_t* dec, const short* data, size_t nsamples, unsigned int* pulses,
+	const int invert)
+{
+	const __m128i vhi = _mm_set1_epi16(LEVEL8(0x80)), vlo = _mm_set1_epi16(LEVEL8(0x7F));
+	const __m128i vt = _mm_set1_epi16((short)get_limits(dec).diff), zero = _mm_setzero_si128();
+	ptrdiff_t last;
+	size_t i, np;
+
+	if (!nsamples)
+		return 0;
+	// the first sample compares against the history, do it the scalar way
+	np = run_scalar(dec, data, 1, pulses, PULSEDEC_ZEROCROSS, invert);
+	last = 1 - (ptrdiff_t)dec->pulselen;
+
+	for (i = 1; i + 64 <= nsamples; i += 64) {
+		uint64_t toggles = 0;
+		unsigned int g, h;
+
+		for (g = 0; g < 64; g += 16) {
+			__m128i s[2], p[2], t[2];
+			sse2_s16_load(data + i + g, &s[0], &s[1], invert);
+			sse2_s16_load(data + i + g - 1, &p[0], &p[1], invert);
+			for (h = 0; h < 2; h++) {
+				// falling: p above and s below the middle, rising: the other way round
+				__m128i fall = _mm_andnot_si128(_mm_cmpgt_epi16(s[h], vlo), _mm_cmpgt_epi16(p[h], vhi));
+				__m128i rise = _mm_andnot_si128(_mm_cmpgt_epi16(p[h], vlo), _mm_cmpgt_epi16(s[h], vhi));
+				// |s - p| as unsigned 16-bit, then > threshold
+				__m128i d = _mm_sub_epi16(_mm_max_epi16(s[h], p[h]), _mm_min_epi16(s[h], p[h]));
+				__m128i big = _mm_cmpeq_epi16(_mm_subs_epu16(d, vt), zero);
+				t[h] = _mm_andnot_si128(big, _mm_or_si128(fall, rise));
+			}
+			toggles |= (uint64_t)sse2_mask16(t[0], t[1]) << g;
+		}
+		np = walk_toggles(dec, toggles, i, &last, pulses, np);
+	}
+	if (i > 1)
+		finish_vector(dec, data, i, last, invert);
+	return np + run_scalar(dec, data + i, nsamples - i, pulses + np, PULSEDEC_ZEROCROSS, invert);
+}
+
+#endif
+
+#ifdef PULSEDEC_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+/* 16 samples per vector */
+TEMPLATE AVX2 __m256i avx2_s16_load(const short* p, const int invert)
+{
+	const __m256i x = _mm256_loadu_si256((const __m256i*)p);
+
+	return invert ? _mm256_xor_si256(x, _mm256_set1_epi16(-1)) : x;
+}
+
+static inline AVX2 unsigned int avx2_mask32(__m256i lo, __m256i hi)
+{
+	// packs works per 128-bit lane, restore the sample order afterwards
+	return (unsigned int)_mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8));
+}
+
+TEMPLATE AVX2 size_t run_hysteresis_avx2(pulsedec_t* dec, const short* data, size_t nsamples, unsigned int* pulses,
+	const int invert)
+{
+	ptrdiff_t last = -(ptrdiff_t)dec->pulselen;
+	size_t i = 0, np = 0;
+	uint64_t set_en, reset_en;
+	int hi, lo;
+
+	hysteresis_window(dec, &hi, &lo, &set_en, &reset_en);
+	{
+		const __m256i vhi = _mm256_set1_epi16((short)hi), vlo = _mm256_set1_epi16((short)lo);
+
+		for (; i + 64 <= nsamples; i += 64) {
+			uint64_t set = 0, reset = 0;
+			unsigned int g;
+
+			for (g = 0; g < 64; g += 32) {
+				__m256i s0 = avx2_s16_load(data + i + g, invert);
+				__m256i s1 = avx2_s16_load(data + i + g + 16, invert);
+				set |= (uint64_t)avx2_mask32(_mm256_cmpgt_epi16(s0, vhi), _mm256_cmpgt_epi16(s1, vhi)) << g;
+				reset |= (uint64_t)(unsigned int)~avx2_mask32(_mm256_cmpgt_epi16(s0, vlo), _mm256_cmpgt_epi16(s1, vlo)) << g;
+			}
+			np = walk_hysteresis(dec, set & set_en, reset & reset_en, i, &last, pulses, np);
+		}
+	}
+	if (i)
+		finish_vector(dec, data, i, last, invert);
+	return np + run_scalar(dec, data + i, nsamples - i, pulses + np, PULSEDEC_HYSTERESIS, invert);
+}
+
+TEMPLATE AVX2 size_t run_zerocross_avx2(pulsedec_t* dec, const short* data, size_t nsamples, unsigned int* pulses,
+	const int invert)
+{
+	const __m256i vhi = _mm256_set1_epi16(LEVEL8(0x80)), vlo = _mm256_set1_epi16(LEVEL8(0x7F));
+	const __m256i vt = _mm256_set1_epi16((short)get_limits(dec).diff), zero = _mm256_setzero_si256();
+	ptrdiff_t last;
+	size_t i, np;
+
+	if (!nsamples)
+		return 0;
+	np = run_scalar(dec, data, 1, pulses, PULSEDEC_ZEROCROSS, invert);
+	last = 1 - (ptrdiff_t)dec->pulselen;
+
+	for (i = 1; i + 64 <= nsamples; i += 64) {
+		uint64_t toggles = 0;
+		unsigned int g, h;
+
+		for (g = 0; g < 64; g += 32) {
+			__m256i t[2];
+			for (h = 0; h < 2; h++) {
+				__m256i s = avx2_s16_load(data + i + g + 16 * h, invert);
+				__m256i p = avx2_s16_load(data + i + g + 16 * h - 1, invert);
+				__m256i fall = _mm256_andnot_si256(_mm256_cmpgt_epi16(s, vlo), _mm256_cmpgt_epi16(p, vhi));
+				__m256i rise = _mm256_andnot_si256(_mm256_cmpgt_epi16(p, vlo), _mm256_cmpgt_epi16(s, vhi));
+				__m256i d = _mm256_sub_epi16(_mm256_max_epi16(s, p), _mm256_min_epi16(s, p));
+				__m256i big = _mm256_cmpeq_epi16(_mm256_subs_epu16(d, vt), zero);
+				t[h] = _mm256_andnot_si256(big, _mm256_or_si256(fall, rise));
+			}
+			toggles |= (uint64_t)avx2_mask32(t[0], t[1]) << g;
+		}
+		np = walk_toggles(dec, toggles, i, &last, pulses, np);
+	}
+	if (i > 1)
+		finish_vector(dec, data, i, last, invert);
+	return np + run_scalar(dec, data + i, nsamples - i, pulses + np, PULSEDEC_ZEROCROSS, invert);
+}
+
+#endif
+
+/*
+	Kernel instances: one function per method and polarity for every
+	template, collected in tables indexed by method.
+*/
+#define METHODS(X) \
+	X(PULSEDEC_COMBINED, combined) \
+	X(PULSEDEC_HYSTERESIS, hysteresis) \
+	X(PULSEDEC_DIFFERENCE, difference) \
+	X(PULSEDEC_ZEROCROSS, zerocross) \
+	X(PULSEDEC_EDGE, edge)
+
+typedef struct {
+	kernel_t		run[2];		// normal and inverted input
+	const char*		name;
+} kernel_entry_t;
+
+#define SCALAR_INSTANCE(method, name) \
+	static size_t scalar_##name(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses) \
+	{ return run_scalar(dec, (const short*)data, nsamples, pulses, method, 0); } \
+	static size_t scalar_##name##_inv(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses) \
+	{ return run_scalar(dec, (const short*)data, nsamples, pulses, method, 1); }
+#define SCALAR_ENTRY(method, name) { { scalar_##name, scalar_##name##_inv }, "scalar " #name },
+
+METHODS(SCALAR_INSTANCE)
+static const kernel_entry_t scalar_kernels[] = { METHODS(SCALAR_ENTRY) };
+
+static size_t words_1bit(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses)
+{
+	return run_1bit(dec, (const unsigned char*)data, nsamples, pulses, 0);
+}
+
+static size_t words_1bit_inv(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses)
+{
+	return run_1bit(dec, (const unsigned char*)data, nsamples, pulses, 1);
+}
+
+static const kernel_entry_t kernel_1bit = { { words_1bit, words_1bit_inv }, "1-bit word" };
+
+// methods without a vector kernel have no entry
+#define VECTOR_INSTANCE(isa, attr, name) \
+	static attr size_t isa##_##name(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses) \
+	{ return run_##name##_##isa(dec, (const short*)data, nsamples, pulses, 0); } \
+	static attr size_t isa##_##name##_inv(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses) \
+	{ return run_##name##_##isa(dec, (const short*)data, nsamples, pulses, 1); }
+#define VECTOR_ENTRY(isa, name, label) { { isa##_##name, isa##_##name##_inv }, label }
+#define NO_ENTRY { { NULL, NULL }, NULL }
+
+#ifdef PULSEDEC_SSE2
+VECTOR_INSTANCE(sse2, , hysteresis)
+VECTOR_INSTANCE(sse2, , zerocross)
+
+static const kernel_entry_t sse2_kernels[] = {
+	NO_ENTRY,
+	VECTOR_ENTRY(sse2, hysteresis, "SSE2 hysteresis"),
+	NO_ENTRY,
+	VECTOR_ENTRY(sse2, zerocross, "SSE2 zero crossing"),
+	NO_ENTRY
+};
+#endif
+
+#ifdef PULSEDEC_AVX2
+VECTOR_INSTANCE(avx2, AVX2, hysteresis)
+VECTOR_INSTANCE(avx2, AVX2, zerocross)
+
+static const kernel_entry_t avx2_kernels[] = {
+	NO_ENTRY,
+	VECTOR_ENTRY(avx2, hysteresis, "AVX2 hysteresis"),
+	NO_ENTRY,
+	VECTOR_ENTRY(avx2, zerocross, "AVX2 zero crossing"),
+	NO_ENTRY
+};
+#endif
+
+// the CPU model is read by a constructor of the runtime before main, so
+// this only reads it: no state of our own to share between threads
+static int have_avx2(void)
+{
+#ifdef PULSEDEC_AVX2
+	return __builtin_cpu_supports("avx2") ? 1 : 0;
+#else
+	return 0;
+#endif
+}
+
+static void select_kernel(pulsedec_t* dec)
+{
+	const unsigned int method = dec->method <= PULSEDEC_EDGE ? dec->method : PULSEDEC_COMBINED;
+	const kernel_entry_t* k = &scalar_kernels[method];
+
+	if (dec->bitspersample == 1) {
+		// no detection needed, the samples are the levels
+		k = &kernel_1bit;
+	}
+#ifdef PULSEDEC_SSE2
+	else if (sse2_kernels[method].name) {
+		k = &sse2_kernels[method];
+#ifdef PULSEDEC_AVX2
+		if (have_avx2())
+			k = &avx2_kernels[method];
+#endif
+	}
+#endif
+	dec->kernel = k->run[dec->invert ? 1 : 0];
+	dec->kernel_name = k->name;
+}
+
+void pulsedec_init(pulsedec_t* dec, unsigned int bitspersample, unsigned int method, int threshold, int invert)
+{
+	dec->method = method;
+	dec->threshold = threshold;
+	dec->invert = invert;
+	dec->bitspersample = (bitspersample == 1) ? 1 : 16;
+	dec->previous_sample = LEVEL8(0);
+	dec->previous_change = 0;
+	dec->lastMax = dec->lastMin = LEVEL8(0);
+	dec->bit = dec->prevbit = 0;
+	dec->pulselen = 0;
+	dec->fresh = 1;
+	select_kernel(dec);
+}
+
+size_t pulsedec_run(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses)
+{
+	const int fresh = dec->fresh;
+	size_t np = dec->kernel(dec, data, nsamples, pulses);
+
+	// at the start of the stream the detector may switch level on the very
+	// first sample: that is the level the signal starts at, not a pulse
+	dec->fresh = 0;
+	if (fresh && np && !pulses[0])
+		memmove(pulses, pulses + 1, --np * sizeof(*pulses));
+	return np;
+}
+
+/*
+	Parallel decoding. The data is cut into segments that are decoded
+	concurrently, each starting from a fresh detector that first runs over
+	a stretch of warm-up samples before the segment. The detector history
+	forgets its past within a few samples (or one local min and max), so
+	after the warm-up it normally matches the state a sequential run would
+	have. The segments are then stitched in order: if the state assumed at
+	a segment start equals the true state at the end of the previous one,
+	its pulses are taken as they are, with the open pulse carried over
+	into the first one; otherwise the segment is decoded again from the
+	true state. Either way the result equals a sequential run.
+*/
+
+#define PARALLEL_WARMUP		(1 << 16)	// samples decoded before a segment
+#define PARALLEL_BATCH		4096		// samples per detector call
+
+typedef struct {
+	pulsedec_t		dec;			// detector, at the segment end when done
+	pulsedec_t		start;			// state assumed at the segment start
+	const void*		data;			// segment start
+	size_t			warmup;			// samples to decode before data
+	size_t			nsamples;
+	unsigned int*	pulses;
+	size_t			npulses, size;
+	int				error;			// out of memory
+} segment_t;
+
+// Address of sample n relative to data, n may be negative
+static const void* sample_at(const pulsedec_t* dec, const void* data, ptrdiff_t n)
+{
+	if (dec->bitspersample == 1)
+		return (const unsigned char*)data + n / 8;
+	return (const short*)data + n;
+}
+
+// Whether both states will decode the same pulses from here on
+static int same_history(const pulsedec_t* a, const pulsedec_t* b)
+{
+	if (a->previous_sample != b->previous_sample || a->previous_change != b->previous_change
+		|| a->lastMax != b->lastMax || a->lastMin != b->lastMin)
+		return 0;
+	// the toggling detectors emit the same pulses whatever the level
+	if (a->bitspersample != 1 && (a->method == PULSEDEC_DIFFERENCE || a->method == PULSEDEC_ZEROCROSS))
+		return 1;
+	return a->bit == b->bit;
+}
+
+static int segment_decode(segment_t* seg, const void* data, size_t nsamples, int keep)
+{
+	size_t i, n, np;
+
+	for (i = 0; i < nsamples; i += n) {
+		n = nsamples - i < PARALLEL_BATCH ? nsamples - i : PARALLEL_BATCH;
+		if (seg->npulses + n > seg->size) {
+			size_t size = 2 * seg->size > seg->npulses + n ? 2 * seg->size : seg->npulses + n;
+			unsigned int* p = realloc(seg->pulses, size * sizeof(*p));
+
+			if (p == NULL)
+				return 0;
+			seg->pulses = p;
+			seg->size = size;
+		}
+		np = pulsedec_run(&seg->dec, sample_at(&seg->dec, data, i), n, seg->pulses + seg->npulses);
+		if (keep)
+			seg->npulses += np;
+	}
+	return 1;
+}
+
+static MTTHREAD_FUNC(segment_worker)
+{
+	segment_t* seg = (segment_t*)arg;
+
+	seg->npulses = 0;
+	seg->error = !segment_decode(seg, sample_at(&seg->dec, seg->data, -(ptrdiff_t)seg->warmup), seg->warmup, 0);
+	// after the warm-up the detector is no longer fresh: an edge on the
+	// first sample ends the pulse open in the previous segment, stitch()
+	// adds that to it
+	seg->dec.pulselen = 0;
+	seg->start = seg->dec;
+	if (!seg->error)
+		seg->error = !segment_decode(seg, seg->data, seg->nsamples, 1);
+	MTTHREAD_RETURN;
+}
+
+static size_t run_sequential(pulsedec_t* dec, const void* data, size_t nsamples,
+	pulsedec_sink sink, void* ctx)
+{
+	unsigned int pulses[PARALLEL_BATCH];
+	size_t i, n, np, total = 0;
+
+	for (i = 0; i < nsamples; i += n) {
+		n = nsamples - i < PARALLEL_BATCH ? nsamples - i : PARALLEL_BATCH;
+		np = pulsedec_run(dec, sample_at(dec, data, i), n, pulses);
+		sink(ctx, pulses, np);
+		total += np;
+	}
+	return total;
+}
+
+// Appends a decoded segment to the sequential state in dec
+static size_t stitch(pulsedec_t* dec, segment_t* seg, pulsedec_sink sink, void* ctx)
+{
+	unsigned int pulselen;
+	unsigned char flip;
+
+	if (seg->error || !same_history(dec, &seg->start)) {
+		// the warm-up did not settle, decode the segment again from the true state
+		return run_sequential(dec, seg->data, seg->nsamples, sink, ctx);
+	}
+	if (seg->npulses) {
+		seg->pulses[0] += dec->pulselen;
+		sink(ctx, seg->pulses, seg->npulses);
+		pulselen = seg->dec.pulselen;
+	}
+	else {
+		pulselen = dec->pulselen + seg->dec.pulselen;
+	}
+	flip = dec->bit ^ seg->start.bit;
+	*dec = seg->dec;
+	dec->bit ^= flip;
+	dec->prevbit ^= flip;
+	dec->pulselen = pulselen;
+	return seg->npulses;
+}
+
+size_t pulsedec_run_parallel(pulsedec_t* dec, const void* data, size_t nsamples,
+	unsigned int nthreads, pulsedec_sink sink, void* ctx)
+{
+	segment_t* segs;
+	mtthread_t* threads;
+	int* started;
+	size_t pos, total = 0;
+	unsigned int k, nseg;
+
+	if (nthreads == 0)
+		nthreads = mtthread_cpus();
+	if (nthreads < 2 || nsamples < 2 * PULSEDEC_SEGMENT)
+		return run_sequential(dec, data, nsamples, sink, ctx);
+
+	segs = calloc(nthreads, sizeof(*segs));
+	threads = calloc(nthreads, sizeof(*threads));
+	started = calloc(nthreads, sizeof(*started));
+	if (segs == NULL || threads == NULL || started == NULL) {
+		free(segs);
+		free(threads);
+		free(started);
+		return run_sequential(dec, data, nsamples, sink, ctx);
+	}
+
+	// one segment per thread at a time, stitched as soon as each one is done
+	for (pos = 0; pos < nsamples; pos += (size_t)nseg * PULSEDEC_SEGMENT) {
+		for (k = 0; k < nthreads && pos + (size_t)k * PULSEDEC_SEGMENT < nsamples; k++) {
+			segment_t* seg = segs + k;
+			size_t s = pos + (size_t)k * PULSEDEC_SEGMENT;
+
+			seg->data = sample_at(dec, data, s);
+			seg->nsamples = nsamples - s < PULSEDEC_SEGMENT ? nsamples - s : PULSEDEC_SEGMENT;
+			if (s == 0) {
+				seg->dec = *dec;
+				seg->warmup = 0;
+			}
+			else {
+				pulsedec_init(&seg->dec, dec->bitspersample, dec->method, dec->threshold, dec->invert);
+				seg->warmup = PARALLEL_WARMUP;
+			}
+			started[k] = mtthread_create(&threads[k], segment_worker, seg) == 0;
+			if (!started[k])
+				segment_worker(seg);
+		}
+		nseg = k;
+		for (k = 0; k < nseg; k++) {
+			if (started[k])
+				mtthread_join(threads[k]);
+			total += stitch(dec, segs + k, sink, ctx);
+		}
+	}
+
+	for (k = 0; k < nthreads; k++)
+		free(segs[k].pulses);
+	free(segs);
+	free(threads);
+	free(started);
+	return total;
+}
+
+/*
+	Sub-sample edge timing. A detector reports an edge at the sample where
+	it switched; the crossing of the middle level (or, for the edge
+	detector, the local extreme) lies somewhat before it, between two
+	samples. Interpolating the samples around it places the edge to a
+	fraction of a sample, which is most of the timing resolution a low
+	sample rate capture loses. Edge times are kept in fixed point relative
+	to the current block, so the refined lengths add up exactly.
+*/
+
+#define EDGE_SEARCH		3	// samples searched back from the switch for the crossing
+
+// Sample i of the block, i may reach back into the history
+static int edge_sample(const pulsedec_edges_t* e, ptrdiff_t i)
+{
+	return i >= 0 ? e->data[i] : e->history[PULSEDEC_HISTORY + i];
+}
+
+// Fraction of the way from y0 to y1 where the line crosses zero
+static double cross_linear(double y0, double y1)
+{
+	return y0 / (y0 - y1);
+}
+
+// The same on the parabola through ym at -1, y0 at 0 and y1 at 1; the
+// line's answer if it has no root between 0 and 1
+static double cross_parabolic(double ym, double y0, double y1)
+{
+	const double a = (y1 + ym) / 2 - y0, b = (y1 - ym) / 2;
+	double d, x;
+
+	if (a != 0 && (d = b * b - 4 * a * y0) >= 0) {
+		d = sqrt(d);
+		x = (-b + d) / (2 * a);
+		if (x >= 0 && x <= 1)
+			return x;
+		x = (-b - d) / (2 * a);
+		if (x >= 0 && x <= 1)
+			return x;
+	}
+	return cross_linear(y0, y1);
+}
+
+// Refined time of an edge the detector found at sample i, in samples
+static double edge_time(const pulsedec_edges_t* e, ptrdiff_t i)
+{
+	ptrdiff_t j;
+
+	if (e->method == PULSEDEC_EDGE) {
+		// the extreme was at i - 1, at the vertex of the parabola through its neighbours
+		if (i - 2 >= -PULSEDEC_HISTORY) {
+			const double y0 = edge_sample(e, i - 2), y1 = edge_sample(e, i - 1), y2 = edge_sample(e, i);
+			const double d = y0 - 2 * y1 + y2;
+
+			if (d != 0)
+				return (double)(i - 1) + (y0 - y2) / (2 * d);
+		}
+		return (double)(i - 1);
+	}
+	// the nearest crossing of the middle level at or before the switch
+	for (j = i; j > i - EDGE_SEARCH && j - 1 >= -PULSEDEC_HISTORY; j--) {
+		const int y0 = edge_sample(e, j - 1), y1 = edge_sample(e, j);
+
+		if ((y0 > 0) != (y1 > 0)) {
+			if (e->interpolation == PULSEDEC_PARABOLIC && j - 2 >= -PULSEDEC_HISTORY)
+				return (double)(j - 1) + cross_parabolic(edge_sample(e, j - 2), y0, y1);
+			return (double)(j - 1) + cross_linear(y0, y1);
+		}
+	}
+	// no crossing near, e.g. a signal off the middle: half a sample before
+	// the switch, where the crossings are on average
+	return (double)i - 0.5;
+}
+
+void pulsedec_edges_init(pulsedec_edges_t* e, const pulsedec_t* dec, unsigned int interpolation)
+{
+	int k;
+
+	e->interpolation = interpolation;
+	e->method = dec->method;
+	for (k = 0; k < PULSEDEC_HISTORY; k++)
+		e->history[k] = 0;
+	e->data = NULL;
+	e->nsamples = 0;
+	e->edge = 0;
+	e->time = 0;
+}
+
+void pulsedec_edges_begin(pulsedec_edges_t* e, const short* data, size_t nsamples)
+{
+	e->data = data;
+	e->nsamples = nsamples;
+}
+
+void pulsedec_edges_end(pulsedec_edges_t* e)
+{
+	const size_t n = e->nsamples;
+	int k;
+
+	// keep the last samples for the edges early in the next block
+	if (n >= PULSEDEC_HISTORY) {
+		for (k = 0; k < PULSEDEC_HISTORY; k++)
+			e->history[k] = e->data[n - PULSEDEC_HISTORY + k];
+	}
+	else if (n) {
+		memmove(e->history, e->history + n, (PULSEDEC_HISTORY - n) * sizeof(int));
+		for (k = 0; k < (int)n; k++)
+			e->history[PULSEDEC_HISTORY - n + k] = e->data[k];
+	}
+	e->edge -= (ptrdiff_t)n;
+	e->time -= (int64_t)n * PULSEDEC_SUBSAMPLE;
+	e->data = NULL;
+	e->nsamples = 0;
+}
+
+void pulsedec_edges_refine(pulsedec_edges_t* e, unsigned int* pulses, size_t count)
+{
+	size_t n;
+
+	for (n = 0; n < count; n++) {
+		const ptrdiff_t i = e->edge + pulses[n];
+		int64_t t = (int64_t)floor(edge_time(e, i) * PULSEDEC_SUBSAMPLE + 0.5);
+		int64_t len = t - e->time;
+
+		// an edge never comes before the previous one
+		if (len < 1) {
+			len = 1;
+			t = e->time + 1;
+		}
+		pulses[n] = len > UINT_MAX ? UINT_MAX : (unsigned int)len;
+		e->edge = i;
+		e->time = t;
+	}
+}
@@ -0,0 +1,110 @@
+/*
+	pulsedec.h
+	(c) 2016, 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Signal detection methods */
+enum {
+	PULSEDEC_COMBINED = 0,
+	PULSEDEC_HYSTERESIS,
+	PULSEDEC_DIFFERENCE,
+	PULSEDEC_ZEROCROSS,
+	PULSEDEC_EDGE,
+	PULSEDEC_METHODS	// number of methods
+};
+
+#define PULSEDEC_SEGMENT	(1 << 22)	// samples per segment of a parallel run
+
+/* Sub-sample edge timing */
+enum {
+	PULSEDEC_WHOLE = 0,		// edges on whole samples
+	PULSEDEC_LINEAR,		// level crossings on the line through two samples
+	PULSEDEC_PARABOLIC		// on the parabola through three
+};
+
+#define PULSEDEC_SUBSAMPLE	64	// refined pulse lengths are in 1/64 samples
+#define PULSEDEC_HISTORY	4	// samples kept from the previous block
+
+typedef struct _PULSEDEC pulsedec_t;
+
+struct _PULSEDEC {
+	unsigned int	method;			// signal detection method
+	int				threshold;		// 0..100
+	int				invert;			// invert input signal
+	unsigned int	bitspersample;	// 1 or 16
+
+	// detector history, carried across blocks
+	int				previous_sample;
+	int				previous_change;
+	int				lastMax, lastMin;
+	unsigned char	bit;			// current decoded level
+	unsigned char	prevbit;
+	unsigned int	pulselen;		// samples since the last transition
+	unsigned char	fresh;			// at the start of the stream, not yet run
+
+	// detector kernel selected for this method and CPU
+	size_t			(*kernel)(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses);
+	const char*		kernel_name;
+};
+
+// Resets the decoder state. Input is 1-bit if bitspersample is 1, signed
+// 16-bit samples (as converted by pcmwav_convert()) otherwise.
+void pulsedec_init(pulsedec_t* dec, unsigned int bitspersample, unsigned int method, int threshold, int invert);
+
+// Decodes nsamples samples from data and stores the length (in samples)
+// of every completed pulse in pulses, which must have room for nsamples
+// entries; returns the number of pulses stored.
+// 1-bit input holds 8 samples per byte, MSB first.
+size_t pulsedec_run(pulsedec_t* dec, const void* data, size_t nsamples, unsigned int* pulses);
+
+// Receives the pulses of pulsedec_run_parallel in order
+typedef void (*pulsedec_sink)(void* ctx, const unsigned int* pulses, size_t count);
+
+// Decodes like pulsedec_run, on up to nthreads threads (0: one per CPU),
+// and hands the pulses to sink in batches; the pulses and the final
+// state are identical to a sequential run. Returns the number of pulses.
+size_t pulsedec_run_parallel(pulsedec_t* dec, const void* data, size_t nsamples,
+	unsigned int nthreads, pulsedec_sink sink, void* ctx);
+
+// Edge refinement state of one decoder, carried across blocks
+typedef struct {
+	unsigned int	interpolation;	// PULSEDEC_LINEAR or PULSEDEC_PARABOLIC
+	unsigned int	method;
+	int				history[PULSEDEC_HISTORY];	// samples before the block, oldest first
+	const short*	data;			// the block being decoded
+	size_t			nsamples;
+	ptrdiff_t		edge;			// sample of the previous edge, relative to the block
+	int64_t			time;			// its refined time, in 1/PULSEDEC_SUBSAMPLE samples
+} pulsedec_edges_t;
+
+// Sets up edge refinement for the pulses of a decoder of 16-bit samples
+void pulsedec_edges_init(pulsedec_edges_t* e, const pulsedec_t* dec, unsigned int interpolation);
+
+// Brackets the decoding of a block: every pulse refined in between must
+// end within it, as the pulses of pulsedec_run_parallel for the block do
+void pulsedec_edges_begin(pulsedec_edges_t* e, const short* data, size_t nsamples);
+void pulsedec_edges_end(pulsedec_edges_t* e);
+
+// Replaces pulse lengths in whole samples, in decoding order, by the
+// distances of the interpolated edges in 1/PULSEDEC_SUBSAMPLE samples.
+// Level detectors are timed where the signal crosses the middle level,
+// the edge detector at the interpolated extreme.
+void pulsedec_edges_refine(pulsedec_edges_t* e, unsigned int* pulses, size_t count);
@@ -0,0 +1,586 @@
+/*
+	pulseenc.c
+	(c) 2003, 2016, 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pulseenc.h"
+
+// Unfiltered output sample for the level wavbyte
+static unsigned char wav_sample(pulseenc_t* enc, unsigned char wavbyte)
+{
+	int output = (255 - enc->gain) / 2 - wavbyte;
+
+	// do clipping
+	if (output < 0)
+		output = 0;
+	else if (output > 255)
+		output = 255;
+	return (unsigned char)(output ^ enc->invert_signal);
+}
+
+static void flush_block(pulseenc_t* enc)
+{
+	int stage = mtstats_enter(enc->stats, MTSTATS_WRITE);
+
+	fwrite(enc->outbuf, 1, enc->outlen, enc->fpout);
+	if (enc->stats)
+		enc->stats->bytes_out += enc->outlen;
+	enc->outlen = 0;
+	mtstats_leave(enc->stats, stage);
+}
+
+// n bytes of the same value
+static void fill_bytes(pulseenc_t* enc, unsigned char value, size_t n)
+{
+	while (n) {
+		size_t k = PULSEENC_BUFSIZE - enc->outlen;
+
+		if (k > n)
+			k = n;
+		memset(enc->outbuf + enc->outlen, value, k);
+		enc->outlen += k;
+		n -= k;
+		if (enc->outlen == PULSEENC_BUFSIZE)
+			flush_block(enc);
+	}
+}
+
+// The first nbytes bytes of w, most significant first
+static void put_word(pulseenc_t* enc, uint64_t w, unsigned int nbytes)
+{
+	unsigned int i;
+
+	if (enc->outlen + nbytes > PULSEENC_BUFSIZE)
+		flush_block(enc);
+	for (i = 0; i < nbytes; i++)
+		enc->outbuf[enc->outlen++] = (unsigned char)(w >> (56 - 8 * i));
+}
+
+/*
+	DC removal: a one pole high pass filter. The input is constant over a
+	run, so the response to a step of d from the filter state is
+	y[k] = d * hpc^k, taken from a table of powers. Once |y| drops below
+	one the output stays at the centre line for the rest of the run.
+*/
+static void filtered_out(pulseenc_t* enc, unsigned char level, unsigned int count)
+{
+	const double d = level - enc->hp_accu;
+	const double* pw = enc->hp_pow;
+	const unsigned char inv = enc->invert_signal;
+	unsigned int n, lo, hi, k, j, m;
+	double y;
+
+	// n: the samples of the run that are off the centre line, via the table
+	lo = 0;
+	hi = count < PULSEENC_HPTAB - 1 ? count : PULSEENC_HPTAB - 1;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi + 1) / 2;
+
+		if (fabs(d) * pw[mid] >= 1.0)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	n = lo;
+
+	for (k = 1; k <= n; k += m) {
+		unsigned char* out = enc->outbuf + enc->outlen;
+
+		m = (unsigned int)(PULSEENC_BUFSIZE - enc->outlen);
+		if (m > n - k + 1)
+			m = n - k + 1;
+		for (j = 0; j < m; j++) {
+			int output = 0x80 - (int)(d * pw[k + j]);
+
+			output = output < 0 ? 0 : output > 255 ? 255 : output;
+			out[j] = (unsigned char)output ^ inv;
+		}
+		enc->outlen += m;
+		if (enc->outlen == PULSEENC_BUFSIZE)
+			flush_block(enc);
+	}
+	// past the table, continue by recurrence
+	if (n == PULSEENC_HPTAB - 1) {
+		for (y = d * pw[n]; k <= count; k++) {
+			int output;
+
+			y *= enc->hpc;
+			if (fabs(y) < 1.0)
+				break;
+			output = 0x80 - (int)y;
+			output = output < 0 ? 0 : output > 255 ? 255 : output;
+			enc->outbuf[enc->outlen++] = (unsigned char)output ^ inv;
+			if (enc->outlen == PULSEENC_BUFSIZE)
+				flush_block(enc);
+		}
+	}
+	fill_bytes(enc, 0x80 ^ inv, count - (k - 1));
+	enc->hp_accu = level - d * (count < PULSEENC_HPTAB ? pw[count] : pow(enc->hpc, count));
+}
+
+/*
+	16-bit, 24-bit and float output, and 8-bit with band-limited edges: the
+	run is first computed as floats normalized to +-1 and then converted to
+	the output format in one pass per chunk; both loops vectorize.
+*/
+static void wide_store(pulseenc_t* enc, const float* v, unsigned int n)
+{
+	const unsigned int bps = enc->bitspersample / 8;
+	unsigned int j, m;
+
+	for (; n; n -= m, v += m) {
+		unsigned char* out = enc->outbuf + enc->outlen;
+
+		m = (unsigned int)((PULSEENC_BUFSIZE - enc->outlen) / bps);
+		if (m > n)
+			m = n;
+		if (m == 0) {
+			flush_block(enc);
+			continue;
+		}
+		switch (enc->bitspersample) {
+		case 8:
+			for (j = 0; j < m; j++) {
+				float x = v[j] < -1.0f ? -1.0f : v[j] > 1.0f ? 1.0f : v[j];
+				int y = (int)(x * 128.0f + 128.5f);
+
+				out[j] = (unsigned char)(y > 255 ? 255 : y);
+			}
+			break;
+		case 16:
+			for (j = 0; j < m; j++) {
+				float x = v[j] < -1.0f ? -1.0f : v[j] > 1.0f ? 1.0f : v[j];
+				short y = (short)((int)(x * 32767.0f + 32768.5f) - 32768);
+
+				memcpy(out + 2 * j, &y, 2);
+			}
+			break;
+		case 24:
+			for (j = 0; j < m; j++) {
+				float x = v[j] < -1.0f ? -1.0f : v[j] > 1.0f ? 1.0f : v[j];
+				int y = (int)(x * 8388607.0f + 8388608.5f) - 8388608;
+
+				out[3 * j] = (unsigned char)y;
+				out[3 * j + 1] = (unsigned char)(y >> 8);
+				out[3 * j + 2] = (unsigned char)(y >> 16);
+			}
+			break;
+		default:
+			for (j = 0; j < m; j++) {
+				float x = v[j] < -1.0f ? -1.0f : v[j] > 1.0f ? 1.0f : v[j];
+
+				memcpy(out + 4 * j, &x, 4);
+			}
+			break;
+		}
+		enc->outlen += (size_t)m * bps;
+	}
+}
+
+/*
+	Band-limited edges. The runs are rendered with ideal edges on whole
+	samples as usual; every edge then adds the difference of a band-limited
+	step at its exact position and the ideal step, taken from a table, to
+	the samples around it. The output is held back by PULSEENC_BLEP_HALF
+	samples for the part of that difference before the edge.
+	The windowed sinc is kept short: a longer one rings more, and where
+	the DC filter has settled on the centre line (pauses, long pulses)
+	the ringing crosses it and reads as extra pulses.
+*/
+#define BLEP_CUTOFF		0.45	// of the sample rate
+#define BLEP_WINDOW		2.0		// samples on either side
+#define BLEP_CROSS_MIN	0.1		// the centre line is kept this far (of the step) from either level
+
+static void blep_init(pulseenc_t* enc)
+{
+	const int half = PULSEENC_BLEP_HALF, res = PULSEENC_BLEP_PHASES;
+	const int n = 2 * (half + 1) * res + 1;
+	double* step = malloc(n * sizeof(double));
+	double x, h, f, prev = 0;
+	int i, p, k;
+
+	memset(enc->blep_fifo, 0, sizeof(enc->blep_fifo));
+	enc->blep_pos = 0;
+	if (!step) {
+		// ideal edges then
+		memset(enc->blep, 0, sizeof(enc->blep));
+		memset(enc->blep_cross, 0, sizeof(enc->blep_cross));
+		return;
+	}
+	// the running integral of a Blackman windowed sinc, 'res' points per sample
+	for (i = 0; i < n; i++) {
+		x = (double)(i - n / 2) / res;
+		if (fabs(x) >= BLEP_WINDOW)
+			h = 0;
+		else {
+			h = 2 * BLEP_CUTOFF * (x == 0 ? 1.0 : sin(2 * M_PI * BLEP_CUTOFF * x) / (2 * M_PI * BLEP_CUTOFF * x));
+			h *= 0.42 + 0.5 * cos(M_PI * x / BLEP_WINDOW) + 0.08 * cos(2 * M_PI * x / BLEP_WINDOW);
+		}
+		step[i] = (i ? step[i - 1] + (h + prev) / (2 * res) : 0);
+		prev = h;
+	}
+	// phase p: the edge is (p / res - 1) samples after the sample it is rendered at
+	for (p = 0; p <= 2 * res; p++)
+		for (k = 0; k < PULSEENC_BLEP_LEN; k++) {
+			i = n / 2 + (k - half) * res - (p - res);
+			enc->blep[p][k] = (float)(step[i] / step[n - 1] - (k >= half ? 1.0 : 0.0));
+		}
+	// where the step reaches p / res of its height, in samples from the edge
+	for (p = 0, i = 1; p <= res; p++) {
+		f = (double)p / res;
+		f = f < BLEP_CROSS_MIN ? BLEP_CROSS_MIN : f > 1 - BLEP_CROSS_MIN ? 1 - BLEP_CROSS_MIN : f;
+		while (i < n - 1 && step[i] / step[n - 1] < f)
+			i++;
+		x = step[i] - step[i - 1];
+		x = i - 1 + (x > 0 ? (f * step[n - 1] - step[i - 1]) / x : 0);
+		enc->blep_cross[p] = (float)((x - n / 2) / res);
+	}
+	free(step);
+}
+
+// Adds an edge of height h at 'offset' (-1..1) samples from the next one
+static void blep_edge(pulseenc_t* enc, float h, double offset)
+{
+	int p = (int)floor((offset + 1) * PULSEENC_BLEP_PHASES + 0.5);
+	int k;
+
+	p = p < 0 ? 0 : p > 2 * PULSEENC_BLEP_PHASES ? 2 * PULSEENC_BLEP_PHASES : p;
+	for (k = 0; k < PULSEENC_BLEP_LEN; k++)
+		enc->blep_fifo[k] += h * enc->blep[p][k];
+}
+
+// Passes n rendered samples through the edge corrections to the output
+static void blep_store(pulseenc_t* enc, const float* v, unsigned int n)
+{
+	float t[PULSEENC_HPTAB + PULSEENC_BLEP_LEN];
+	unsigned int j, skip;
+
+	memcpy(t, enc->blep_fifo, sizeof(enc->blep_fifo));
+	memset(t + PULSEENC_BLEP_LEN, 0, n * sizeof(float));
+	for (j = 0; j < n; j++)
+		t[PULSEENC_BLEP_HALF + j] += v[j];
+	// the first samples held back are before the start
+	skip = enc->blep_pos < PULSEENC_BLEP_HALF ? (unsigned int)(PULSEENC_BLEP_HALF - enc->blep_pos) : 0;
+	if (skip > n)
+		skip = n;
+	wide_store(enc, t + skip, n - skip);
+	memcpy(enc->blep_fifo, t + n, sizeof(enc->blep_fifo));
+	enc->blep_pos += n;
+}
+
+static void run_store(pulseenc_t* enc, const float* v, unsigned int n)
+{
+	if (enc->bandlimit)
+		blep_store(enc, v, n);
+	else
+		wide_store(enc, v, n);
+}
+
+// A run of count samples at the level wavbyte
+static void wide_out(pulseenc_t* enc, unsigned char level, unsigned int count)
+{
+	const float sign = enc->invert_signal ? 1.0f / 128 : -1.0f / 128;
+	const double* pw = enc->hp_pow;
+	float v[PULSEENC_HPTAB];
+	double d, s;
+	unsigned int k, j, m;
+
+	if (enc->nofilter) {
+		// a constant level around the centre line
+		const float x = sign * (float)(level - enc->gain / 2);
+
+		for (j = 0; j < PULSEENC_HPTAB && j < count; j++)
+			v[j] = x;
+		for (k = 0; k < count; k += m) {
+			m = count - k < PULSEENC_HPTAB ? count - k : PULSEENC_HPTAB;
+			run_store(enc, v, m);
+		}
+		return;
+	}
+	// the step response d * hpc^k, one table length at a time
+	d = level - enc->hp_accu;
+	for (k = 0, s = d; k < count; k += m, s *= pw[m]) {
+		m = count - k < PULSEENC_HPTAB - 1 ? count - k : PULSEENC_HPTAB - 1;
+		if (fabs(s) < enc->flat) {
+			m = count - k;
+			memset(v, 0, sizeof(v));
+			for (; m; m -= j) {
+				j = m < PULSEENC_HPTAB ? m : PULSEENC_HPTAB;
+				run_store(enc, v, j);
+			}
+			break;
+		}
+		for (j = 0; j < m; j++)
+			v[j] = sign * (float)(s * pw[j + 1]);
+		run_store(enc, v, m);
+	}
+	enc->hp_accu = level - d * (count < PULSEENC_HPTAB ? pw[count] : pow(enc->hpc, count));
+}
+
+/*
+	1-bit output: samples are collected MSB first in a 64-bit word that
+	is stored when full. A run that finds the word empty is written as
+	whole 0x00 or 0xFF bytes.
+*/
+static void bits_out(pulseenc_t* enc, unsigned int count)
+{
+	const uint64_t fill = enc->edge ? ~(uint64_t)0 : 0;
+	unsigned int k;
+
+	while (count) {
+		if (enc->nbits == 0 && count >= 64) {
+			fill_bytes(enc, (unsigned char)fill, count / 8);
+			count &= 7;
+			continue;
+		}
+		k = 64 - enc->nbits;
+		if (k > count)
+			k = count;
+		enc->bitacc |= (fill >> enc->nbits) & ~((UINT64_C(1) << (64 - enc->nbits - k)) - 1);
+		enc->nbits += k;
+		count -= k;
+		if (enc->nbits == 64) {
+			put_word(enc, enc->bitacc, 8);
+			enc->bitacc = 0;
+			enc->nbits = 0;
+		}
+	}
+}
+
+static void wave_out(pulseenc_t* enc, unsigned int count)
+{
+	if (enc->bitspersample == 1) {
+		bits_out(enc, count);
+		enc->edge ^= 1;
+	}
+	else if (enc->bitspersample > 8) {
+		wide_out(enc, enc->wavbyte, count);
+		// invert wave
+		enc->wavbyte ^= enc->gain;
+	}
+	else {
+		if (enc->nofilter) {
+			// the level is constant over the run
+			fill_bytes(enc, wav_sample(enc, enc->wavbyte), count);
+		}
+		else {
+			filtered_out(enc, enc->wavbyte, count);
+		}
+		// invert wave
+		enc->wavbyte ^= enc->gain;
+	}
+}
+
+/*
+	A run that ends in a band-limited edge 'offset' samples after the next
+	sample. The detectors, like the tape hardware, time an edge where it
+	crosses the centre line; with the DC filter the levels on either side
+	are uneven, and a step centred on the edge would cross the line early
+	or late. The step is moved so that it crosses the line on time.
+*/
+static void edge_out(pulseenc_t* enc, unsigned int count, double offset)
+{
+	const float sign = enc->invert_signal ? 1.0f / 128 : -1.0f / 128;
+	const unsigned char level = enc->wavbyte, next = level ^ enc->gain;
+	double f;
+
+	wide_out(enc, level, count);
+	// the fraction of the step below the centre line
+	f = (level - (enc->nofilter ? enc->gain / 2.0 : enc->hp_accu)) / ((double)level - next);
+	f = f < 0 ? 0 : f > 1 ? 1 : f;
+	offset -= enc->blep_cross[(int)(f * PULSEENC_BLEP_PHASES + 0.5)];
+	blep_edge(enc, sign * ((float)next - (float)level), offset);
+	enc->wavbyte = next;
+}
+
+// Samples for 'cycles' machine cycles, the rounding remainder is carried
+// to the next pulse in *frac so the timeline never drifts
+static unsigned int cycles_to_samples(const pulseenc_t* enc, unsigned long long cycles, unsigned int* frac)
+{
+	unsigned long long n = cycles * enc->samplerate + *frac;
+
+	*frac = (unsigned int)(n % enc->clock);
+	return (unsigned int)(n / enc->clock);
+}
+
+// Same for a TAP byte value, by table lookup
+static unsigned int byte_to_samples(const pulseenc_t* enc, unsigned char value, unsigned int* frac)
+{
+	unsigned int n = enc->wave_samples[value];
+
+	*frac += enc->wave_frac[value];
+	if (*frac >= enc->clock) {
+		*frac -= enc->clock;
+		n++;
+	}
+	return n;
+}
+
+static unsigned int pulse_samples(const pulseenc_t* enc, const mtap_pulse_t* pulse, unsigned int* frac)
+{
+	if (pulse->value)
+		return byte_to_samples(enc, pulse->value, frac);
+	if (enc->version == 0)
+		return cycles_to_samples(enc, (unsigned long long)MTAP_V0_PAUSE(enc->mtap_frequency) * pulse->length, frac);
+	return cycles_to_samples(enc, pulse->length, frac);
+}
+
+int pulseenc_init(pulseenc_t* enc, FILE* fpout, unsigned int version, unsigned int mtap_frequency)
+{
+	unsigned int i;
+
+	if ((enc->outbuf = malloc(PULSEENC_BUFSIZE)) == NULL)
+		return 1;
+	enc->outlen = 0;
+	enc->fpout = fpout;
+	enc->version = version;
+	enc->mtap_frequency = mtap_frequency;
+	enc->clock = mtap_frequency * 8;
+	for (i = 0; i < 256; i++) {
+		unsigned long long n = (unsigned long long)i * 8 * enc->samplerate;
+
+		enc->wave_samples[i] = (unsigned int)(n / enc->clock);
+		enc->wave_frac[i] = (unsigned int)(n % enc->clock);
+	}
+	// start half a sample in, so every edge lands on the nearest sample
+	enc->frac = enc->clock / 2;
+	enc->hpc = exp(-2.0 * M_PI * enc->cutoff / enc->samplerate);
+	enc->hp_pow[0] = 1.0;
+	for (i = 1; i < PULSEENC_HPTAB; i++)
+		enc->hp_pow[i] = enc->hp_pow[i - 1] * enc->hpc;
+	enc->hp_accu = 0;
+	// below half an LSB the filtered output is flat, in 8-bit units
+	enc->flat = enc->bitspersample == 16 ? 64.0 / 32767 : 64.0 / 8388607;
+	enc->wavbyte = (version == 2) ? PULSEENC_GAIN : 0x00;
+	enc->edge = enc->invert_signal ? 0 : 1;
+	enc->bitacc = 0;
+	enc->nbits = 0;
+	enc->data_length = 0;
+	// 1-bit output has no levels in between
+	if (enc->bitspersample == 1)
+		enc->bandlimit = 0;
+	if (enc->bandlimit)
+		blep_init(enc);
+	return 0;
+}
+
+// Band-limited rendering: edges are placed at their exact time, that is
+// (frac - clock / 2) / clock samples after the sample they are rendered at
+static void pulse_bandlimited(pulseenc_t* enc, unsigned int half_wave_time, unsigned int startfrac)
+{
+	const long long clock = enc->clock;
+	long long start, end, mid;
+	unsigned int halfpulse;
+
+	if (enc->version == 2) {
+		edge_out(enc, half_wave_time, (double)((long long)enc->frac - clock / 2) / clock);
+		return;
+	}
+	// the middle edge of a full wave halfway between the exact ends,
+	// times in 1/clock samples from the start of the pulse
+	start = (long long)startfrac - clock / 2;
+	end = (long long)half_wave_time * clock + enc->frac - clock / 2;
+	mid = start + (end - start) / 2;
+	halfpulse = (unsigned int)((mid + clock / 2) / clock);
+	edge_out(enc, halfpulse, (double)(mid - (long long)halfpulse * clock) / clock);
+	edge_out(enc, half_wave_time - halfpulse, (double)((long long)enc->frac - clock / 2) / clock);
+}
+
+/* TAP pulse interpreter */
+void pulseenc_pulses(pulseenc_t* enc, const mtap_pulse_t* pulses, size_t count)
+{
+	unsigned long long start = enc->data_length;
+	unsigned int half_wave_time, halfpulse;
+	size_t n;
+	int stage = mtstats_enter(enc->stats, MTSTATS_ENCODE);
+
+	for (n = 0; n < count; n++) {
+		const unsigned int startfrac = enc->frac;
+
+		half_wave_time = pulse_samples(enc, pulses + n, &enc->frac);
+
+		if (enc->bandlimit)
+			pulse_bandlimited(enc, half_wave_time, startfrac);
+		else if (enc->version == 2) {
+			// v2 bytes are half waves
+			wave_out(enc, half_wave_time);
+		}
+		else {
+			halfpulse = half_wave_time / 2;
+			wave_out(enc, halfpulse);
+			wave_out(enc, half_wave_time - halfpulse);
+		}
+		enc->data_length += half_wave_time;
+	}
+	if (enc->stats) {
+		enc->stats->pulses += count;
+		enc->stats->samples += enc->data_length - start;
+	}
+	mtstats_leave(enc->stats, stage);
+}
+
+void pulseenc_measure_init(const pulseenc_t* enc, pulseenc_size_t* size)
+{
+	size->samples = 0;
+	size->frac = enc->clock / 2;
+}
+
+void pulseenc_measure(const pulseenc_t* enc, const mtap_pulse_t* pulses, size_t count, pulseenc_size_t* size)
+{
+	size_t n;
+
+	for (n = 0; n < count; n++)
+		size->samples += pulse_samples(enc, pulses + n, &size->frac);
+}
+
+unsigned long long pulseenc_data_size(const pulseenc_t* enc, unsigned long long samples)
+{
+	if (enc->bitspersample == 1)
+		return (samples + 7) / 8;
+	return samples * (enc->bitspersample / 8);
+}
+
+unsigned int pulseenc_finish(pulseenc_t* enc)
+{
+	unsigned long long n = enc->data_length;
+
+	if (enc->bitspersample == 1) {
+		// pad the last partial byte with the last level, the data size is in bytes
+		if (enc->nbits) {
+			if (!enc->edge)
+				enc->bitacc |= ~(uint64_t)0 >> enc->nbits;
+			put_word(enc, enc->bitacc, (enc->nbits + 7) / 8);
+		}
+		n = (n + 7) / 8;
+	}
+	else {
+		// the samples held back for the last edges
+		if (enc->bandlimit) {
+			unsigned int held = enc->blep_pos < PULSEENC_BLEP_HALF ? (unsigned int)enc->blep_pos : PULSEENC_BLEP_HALF;
+
+			wide_store(enc, enc->blep_fifo + PULSEENC_BLEP_HALF - held, held);
+		}
+		n *= enc->bitspersample / 8;
+	}
+	flush_block(enc);
+	free(enc->outbuf);
+	enc->outbuf = NULL;
+	return (unsigned int)n;
+}
@@ -0,0 +1,105 @@
+/*
+	pulseenc.h
+	(c) 2003, 2016, 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "mtap.h"
+#include "mtstats.h"
+
+#define PULSEENC_GAIN 0xC0	/* default amplitude */
+#define PULSEENC_BUFSIZE (1<<20)	/* output block size */
+#define PULSEENC_HPTAB 4096		/* high pass step response table length */
+#define PULSEENC_BLEP_HALF 3		/* band-limited step: samples on either side of an edge */
+#define PULSEENC_BLEP_LEN (2 * PULSEENC_BLEP_HALF)
+#define PULSEENC_BLEP_PHASES 64	/* edge positions within a sample */
+
+/* TAP to PCM encoder state */
+typedef struct {
+	// output format
+	unsigned int	samplerate;
+	unsigned int	bitspersample;	// 1, 8, 16, 24 or 32 (float)
+	unsigned char	invert_signal;	// 0x00 or 0xFF
+	unsigned char	gain;
+	double			cutoff;			// high pass filter cutoff in Hz
+	unsigned int	nofilter;
+	unsigned int	bandlimit;		// band-limited edges at their exact positions
+	mtstats_t*		stats;			// counters and timers, NULL: none
+
+	// TAP image
+	unsigned int	version;
+	unsigned int	mtap_frequency;	// TAP units per second
+	unsigned int	clock;			// machine cycles per second
+
+	// samples per TAP byte value, whole and the remainder in 1/clock
+	// samples; built once per sample rate and clock
+	unsigned int	wave_samples[256];
+	unsigned int	wave_frac[256];
+
+	// rendering state
+	double			hp_accu;		// high pass filter pole
+	double			hpc;			// filter coefficient
+	double			hp_pow[PULSEENC_HPTAB];	// hpc^k
+	double			flat;			// filter output treated as zero
+	unsigned char	wavbyte;		// current level
+	unsigned int	edge;			// current 1-bit level
+	uint64_t		bitacc;			// 1-bit output: pending samples, MSB first
+	unsigned int	nbits;
+	unsigned long long	data_length;	// samples written so far
+	unsigned int	frac;			// timeline remainder in 1/clock samples
+	FILE*			fpout;
+	unsigned char*	outbuf;			// output block
+	size_t			outlen;
+
+	// band-limited edges: the band-limited step less the ideal one, for
+	// every edge position within a sample either way, the time the step
+	// takes to reach every fraction of its height, and the output samples
+	// they still add to
+	float			blep[2 * PULSEENC_BLEP_PHASES + 1][PULSEENC_BLEP_LEN];
+	float			blep_cross[PULSEENC_BLEP_PHASES + 1];
+	float			blep_fifo[PULSEENC_BLEP_LEN];	// PULSEENC_BLEP_HALF samples held back, as many ahead
+	unsigned long long	blep_pos;	// samples rendered
+} pulseenc_t;
+
+/* Length of the rendered output, accumulated by pulseenc_measure */
+typedef struct {
+	unsigned long long	samples;
+	unsigned int		frac;		// timeline remainder, as in the encoder
+} pulseenc_size_t;
+
+// Sets up the encoder for a TAP image of the given version and clock
+// after the output format fields have been filled in; returns 0 on
+// success, 1 if the output block cannot be allocated
+int pulseenc_init(pulseenc_t* enc, FILE* fpout, unsigned int version, unsigned int mtap_frequency);
+
+// Renders a batch of pulses from the TAP reader
+void pulseenc_pulses(pulseenc_t* enc, const mtap_pulse_t* pulses, size_t count);
+
+// Starts measuring the output of an encoder set up by pulseenc_init
+void pulseenc_measure_init(const pulseenc_t* enc, pulseenc_size_t* size);
+
+// Adds the samples that the pulses will render to, without rendering
+void pulseenc_measure(const pulseenc_t* enc, const mtap_pulse_t* pulses, size_t count, pulseenc_size_t* size);
+
+// Data bytes for a number of samples in the output format
+unsigned long long pulseenc_data_size(const pulseenc_t* enc, unsigned long long samples);
+
+// Flushes pending output and frees the output block; returns the number
+// of data bytes written
+unsigned int pulseenc_finish(pulseenc_t* enc);
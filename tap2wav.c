@@ -24,6 +24,12 @@
 #include <math.h>
 #include <limits.h>
 #include "mtap.h"
+#include "pulseenc.h"
+#include "mtstats.h"
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 #define COPYRIGHT_NOTICE	"tap2wav v1.3 (C) 2003, 2016, 2023 by A Grosz\n" \
 							"Commodore MTAP tape image to PCM WAV converter\n"
@@ -38,10 +44,7 @@ const char* videostd[] = {
 
 #define WAVEFREQ 44100          /* Default wave frequency */
 
-#define MAXSTRLEN 80
-#define ZERO (wave.nSamplesPerSec/50)   /* approx. 1/50s, length of a V0 '00'-pause */
-
-#define GAIN 0xC0
+#define GAIN PULSEENC_GAIN
 
 /* should be 1-byte aligned */
 #pragma pack(1)
@@ -74,273 +77,115 @@ struct wav_header {
 	{'d','a','t','a'},
 	0
 };
+
+/* WAVE_FORMAT_EXTENSIBLE header, used for 24-bit and float output */
+struct wav_header_ext {
+	char riff[4];
+	unsigned int file_size;
+	char WAVEfmt[8];
+	unsigned int fLen; /* 40 */
+	unsigned short wFormatTag; /* 0xFFFE */
+	unsigned short nChannels;
+	unsigned int nSamplesPerSec;
+	unsigned int nAvgBytesPerSec;
+	unsigned short nBlockAlign;
+	unsigned short nBitsPerSample;
+	unsigned short cbSize; /* 22 */
+	unsigned short wValidBitsPerSample;
+	unsigned int dwChannelMask; /* SPEAKER_FRONT_CENTER */
+	unsigned char SubFormat[16];
+	char datastr[4];
+	unsigned int data_size;
+} wave_ext = {
+	{'R','I','F','F'},
+	0,
+	{'W','A','V','E','f','m','t', ' '},
+	40,
+	0xFFFE,
+	0x0001,
+	WAVEFREQ,
+	WAVEFREQ,
+	0x0001,
+	0x0008,
+	22,
+	0x0008,
+	0x0004,
+	/* KSDATAFORMAT_SUBTYPE_PCM, the first word is 3 for IEEE float */
+	{ 0x01,0x00,0x00,0x00, 0x00,0x00, 0x10,0x00, 0x80,0x00, 0x00,0xAA,0x00,0x38,0x9B,0x71 },
+	{'d','a','t','a'},
+	0
+};
 #pragma pack()
 
 struct _options {
-	unsigned char invert_signal;
-	unsigned char gain;
-	double cutoff;
 	unsigned int quiet;
-	unsigned int nofilter;
+	unsigned int stats_json;
 } options;
 
 /* Global variables */
-static unsigned int data_length;
-static unsigned int pause;
-static unsigned int half_wave_time;
-static unsigned int halfpulse;
-static tap_image_t tap;
-static unsigned char* buffer, * buffer_end;
-static FILE* fpin, * fpout;
-static unsigned int pulsestat[256];
-static unsigned int mtap_frequency;
-static unsigned int edge;
-
-typedef void (*tap_interpreters)(unsigned char byte);
-static void _interpret_v0_byte(unsigned char byte);
-static void _interpret_v1_byte(unsigned char byte);
-static void _interpret_v2_byte(unsigned char byte);
-static tap_interpreters interpret_tap_byte[] = {
-	_interpret_v0_byte,
-	_interpret_v1_byte,
-	_interpret_v2_byte,
-	NULL
-};
-
-static int iirFilter(unsigned char in)
-{
-	const double hpc = exp(-2.0 * M_PI * options.cutoff / wave.nSamplesPerSec);
-	static double hp_accu = 0;
-
-	double accu = (double)in;
-	// update hp filter pole
-	hp_accu = hpc * hp_accu + (1 - hpc) * accu;
-	// apply high pass filtering
-	accu = accu - hp_accu;
-
-	return (int)accu;
-}
-
-static void wav_write(unsigned char wavbyte)
-{
-	unsigned char outByte;
-	int output = options.nofilter ? (255 - options.gain) / 2 - wavbyte : 0x80 - iirFilter(wavbyte);
-
-	// do clipping
-	if (output < 0)
-		output = 0;
-	else if (output > 255)
-		output = 255;
-	outByte = output & 0xFF;
-	fputc(outByte ^ options.invert_signal, fpout);
-}
-
-static void wave_out(unsigned int count, unsigned char* out)
-{
-	if (wave.nBitsPerSample == 1) {
-		static unsigned int bitcount = 1;
-		for (unsigned int i = 0; i < count; i++) {
-			bitcount = (bitcount << 1) | edge;
-			if (bitcount & 0x100) {
-				unsigned char out = bitcount & 0xFF;
-				fputc(out, fpout);
-				bitcount = 1;
-			}
-		}
-		edge ^= 1;
-	}
-	else {
-		while (count--) {
-			wav_write(*out);
-		}
-		// invert wave
-		*out ^= options.gain;
-	}
-}
-
-/* tap byte interpreter functions */
-static void _interpret_v0_byte(unsigned char byte)
-{
-	static unsigned char wavbyte = 0;
-
-	if (byte != 0x00) {
-		half_wave_time = (long)((byte * wave.nSamplesPerSec + mtap_frequency / 2) / mtap_frequency);
-	}
-	else {
-		pause = ZERO;
-		for (; (*(buffer + 1) == 0) && ((buffer + 1) < buffer_end); buffer++)
-			pause += ZERO;
-		half_wave_time = (long)(((pause >> 3) * wave.nSamplesPerSec + mtap_frequency / 2) / mtap_frequency);
-	}
-	halfpulse = half_wave_time / 2;
-	wave_out(halfpulse, &wavbyte);
-	halfpulse = half_wave_time - halfpulse;
-	wave_out(halfpulse, &wavbyte);
-	data_length += half_wave_time;
-}
-
-static void _interpret_v1_byte(unsigned char byte)
-{
-	static unsigned char wavbyte = 0x00;
-	int i;
-
-	if (byte != 0x00) {
-		half_wave_time = (long)((byte * wave.nSamplesPerSec + mtap_frequency / 2) / mtap_frequency);
-	}
-	else {
-		if ((buffer + 3) >= buffer_end)
-			return;
-		pause = 0;
-		for (i = 0; i < 3; i++) {
-			buffer++;
-			pause >>= 8;
-			pause += (*buffer << 16);
-		}
-		half_wave_time = (long)(((pause >> 3) * wave.nSamplesPerSec + mtap_frequency / 2) / mtap_frequency);
-	}
-	halfpulse = half_wave_time / 2;
-	wave_out(halfpulse, &wavbyte);
-	halfpulse = half_wave_time - halfpulse;
-	wave_out(halfpulse, &wavbyte);
-	data_length += half_wave_time;
-}
-
-static void _interpret_v2_byte(unsigned char byte)
-{
-	static unsigned char wavbyte = GAIN;//0x00;
-	unsigned int i;
-
-	if (byte != 0x00) {
-		half_wave_time = (long)((byte * wave.nSamplesPerSec + mtap_frequency / 2) / mtap_frequency);
-	}
-	else {
-		if ((buffer + 3) >= buffer_end)
-			return;
-		pause = 0;
-		for (i = 0; i < 3; i++) {
-			buffer++;
-			pause >>= 8;
-			pause += (*buffer << 16);
-		}
-		half_wave_time = (long)(((pause >> 3) * wave.nSamplesPerSec + mtap_frequency / 2) / mtap_frequency);
-	}
-
-	halfpulse = half_wave_time;
-	wave_out(halfpulse, &wavbyte);
-	data_length += half_wave_time;
-}
-
-static int freadbyte(FILE* fpin)
-{
-	/* read one byte from *fpin, abort if none available */
-	int c;
+static mtap_reader_t tap;
+static FILE* fpout;
+static FILE* msg;		/* messages, stderr when the WAV goes to stdout */
+static pulseenc_t encoder;
+static mtstats_t stats;
 
-	if ((c = fgetc(fpin)) == EOF) {
-		fprintf(stderr, "unexpected End of File!\n");
-		exit(6);
-	}
-	return c;
-}
+#define PULSE_BATCH 4096
 
-static int read_tap_data(FILE* fpin, tap_image_t* tap)
+static void read_tap_header(const char* fname, mtap_reader_t* tap)
 {
-	unsigned long filelength;
-	char inputstring[MAXSTRLEN];
-	int i;
-
-	/* figure out file length */
-	fseek(fpin, 0, SEEK_END);
-	filelength = ftell(fpin);
-	rewind(fpin);
-
-	/* check "C16-TAPE-RAW" string */
-	fgets(inputstring, 13, fpin);
-	if (strncmp(inputstring + 4, "TAPE-RAW", 8) != 0) {
+	switch (mtap_open(tap, fname)) {
+	case 0:
+		break;
+	case 1:
+		fprintf(stderr, "Couldn't open TAP file %s!\n", fname);
+		exit(2);
+	case 2:
 		fprintf(stderr, "invalid or corrupt TAP file!\n");
 		exit(5);
-	}
-
-	/* read the TAP-file version */
-	tap->version = freadbyte(fpin);
-	if ((tap->version < 0) || (tap->version > 2)) {
+	case 3:
 		fprintf(stderr, "TAP Version not (yet) supported, sorry!\n");
 		exit(6);
+	default:
+		fprintf(stderr, "Couldn't allocate buffer memory!\n");
+		exit(7);
 	}
 
-	/* read additional TAP info fields */
-	tap->machine = freadbyte(fpin);
-	printf("Machine type : %s\n", machine[tap->machine]);
-	tap->video_standard = freadbyte(fpin);
-	if (tap->video_standard > 1) {
-		fprintf(stderr, "Illegal video standard value (%x) set to PAL.\n", tap->video_standard);
-		tap->video_standard = 0;
+	/* additional TAP info fields */
+	fprintf(msg, "Machine type : %s\n", tap->header.machine <= C264 ? machine[tap->header.machine] : "unknown");
+	if (tap->header.video_standard > 1) {
+		fprintf(stderr, "Illegal video standard value (%x) set to PAL.\n", tap->header.video_standard);
+		tap->header.video_standard = 0;
 	}
 	else
-		printf("Video standard : %s\n", videostd[tap->video_standard]);
-	freadbyte(fpin);
-
-	switch (tap->machine) {
-	case VIC:
-		mtap_frequency =
-			(tap->video_standard == NTSC) ? VICNTSCFREQ : VICPALFREQ;
-		break;
-	case C264:
-		mtap_frequency =
-			(tap->video_standard == NTSC) ? C16NTSCFREQ : C16PALFREQ;
-		break;
-	case C64:
-	default:
-		mtap_frequency =
-			(tap->video_standard == NTSC) ? C64NTSCFREQ : C64PALFREQ;
-		break;
-	}
-	printf("Tape frequency : %d\n", (mtap_frequency) << 3);
-	/* read the data length */
-	for (tap->size = 0, i = 0; i < 4; i++) {
-		tap->size >>= 8;
-		tap->size += (freadbyte(fpin) << 24);
-	}
-	printf("TAP data length : %d\n", tap->size);
+		fprintf(msg, "Video standard : %s\n", videostd[tap->header.video_standard]);
+	fprintf(msg, "Tape frequency : %d\n", (tap->tap_frequency) << 3);
+	fprintf(msg, "TAP data length : %d\n", tap->header.size);
 
 	/* check if data length is valid */
-	unsigned int real_length = filelength - MTAP_HEADER_LEN;
-	if (tap->size != real_length) {
+	if (tap->header.size != tap->datasize) {
 		fprintf(stderr, "WARNING: file size doesn't match header (%ukb vs %ukb)!\n",
-			(unsigned int)(real_length / 1024 + 0.5), (unsigned int)(tap->size / 1024 + 0.5));
-		if (tap->size != real_length) {
-			tap->size = real_length;
-			fprintf(stderr, "TAP size corrected to actual size.\n");
-		}
+			(unsigned int)(tap->datasize / 1024 + 0.5), (unsigned int)(tap->header.size / 1024 + 0.5));
+		fprintf(stderr, "TAP size corrected to actual size.\n");
 	}
-	printf("TAP version : %d\n", tap->version);
-	/* allocate buffer for TAP data */
-	if ((tap->data = (unsigned char*)calloc(tap->size, sizeof(unsigned char))) == NULL) {
-		fprintf(stderr, "Couldn't allocate buffer memory!\n");
-		exit(7);
-	}
-
-	/* read in TAP data */
-	if (fread(tap->data, sizeof(unsigned char), tap->size, fpin) != tap->size) {
-		fprintf(stderr, "Couldn't read whole TAP file!\n");
-		//exit(8);
-	}
-	return -1;
+	fprintf(msg, "TAP version : %d\n", tap->header.version);
 }
 
-static void tap_statistics(tap_image_t* t)
+static void tap_statistics(mtap_reader_t* t)
 {
+	unsigned int pulsestat[256];
 	unsigned int i;
 	unsigned int maxpulslen = 0;
-	unsigned int limit = 0xc0 >> (t->version > 1 ? 1 : 0);
+	unsigned int limit = 0xc0 >> (t->header.version > 1 ? 1 : 0);
+	const unsigned char* data;
+	size_t n, j;
 
 	// empty count
 	memset(pulsestat, 0, sizeof(pulsestat));
-	// count pulse frequencies
-	for (i = 0; i < t->size; i++) {
-		if (t->data[i] <= limit) {
-			pulsestat[t->data[i]] += 1;
-		}
-	}
+	// count pulse frequencies in a pass over the data
+	while ((data = mtap_read_block(t, &n)) != NULL)
+		for (j = 0; j < n; j++)
+			pulsestat[data[j]] += 1;
+	mtap_rewind(t);
 	// find highest count
 	for (i = 0; i < limit; i++) {
 		if (maxpulslen < pulsestat[i])
@@ -349,72 +194,86 @@ static void tap_statistics(tap_image_t* t)
 	// write stats
 	for (i = 0; i < limit; i++)
 		if (pulsestat[i]) {
-			printf("  $%02X : %-12u", i, pulsestat[i]);
+			fprintf(msg, "  $%02X : %-12u", i, pulsestat[i]);
 			unsigned int k = pulsestat[i] * 50 / maxpulslen;
 			while (k--) {
-				printf(".");
+				fprintf(msg, ".");
 			}
-			printf("\n");
+			fprintf(msg, "\n");
 		}
 }
 
 int main(int argc, char* argv[])
 {
-	char tap_file_name[PATH_MAX];
-
+	mtap_pulse_t pulses[PULSE_BATCH];
+	pulseenc_size_t size;
+	size_t n;
+	unsigned long long data_size;
+	unsigned int data_length, progress = 0;
+	void* header = &wave;
+	unsigned int header_len = sizeof(wave);
 	int i;
 
+	mtstats_init(&stats);
+	msg = stdout;
 	if (argc < 3) {
 		fprintf(stderr, "\n%s\n", COPYRIGHT_NOTICE);
 		fprintf(stderr, "Usage: tap2wav <tapfile> <outputfile> [options]\n"
+			"       (outputfile '-' writes the WAV to stdout)\n"
+			"       -a       : band-limited edges at their exact positions, for low sample rates\n"
 			"       -b       : generate special 1-bit WAV (more efficient than MTAP)\n"
 			"       -c FRQ   : set high pass filter cutoff to 'FRQ' (default: 400 Hz)\n"
+			"       -d BITS  : sample format 8, 16, 24 or 32 (float) bits (default: 8)\n"
 			"       -f FRQ   : change sample frequency to 'FRQ' (default: 44100)\n"
 			"       -g GAIN  : change amplitude to 'GAIN' (default: 192)\n"
 			"       -i       : invert signal\n"
 			"       -n       : no DC removal filter\n"
-			"       -q       : suppress statistics\n");
+			"       -q       : suppress statistics\n"
+			"       --stats=json : print stage timings and counters as JSON to stdout\n"
+			"                  (to stderr with outputfile '-'), messages go to stderr\n");
 		exit(1);
 	}
 
-	strcpy(tap_file_name, argv[1]);
-
-	printf("Opening TAP file %s\n", argv[1]);
-	if ((fpin = fopen(tap_file_name, "rb")) == NULL) {
-		fprintf(stderr, "Couldn't open TAP file %s!\n", tap_file_name);
-		exit(2);
-	}
-	printf("Reading TAP header\n");
-	if (!read_tap_data(fpin, &tap)) {
-		fprintf(stderr, "Couldn't read TAP file %s!\n", tap_file_name);
-		exit(3);
-	}
+	// the JSON report takes stdout, so it must be known before any message
+	for (i = 3; i < argc; i++)
+		if (!strcmp(argv[i], "--stats=json"))
+			options.stats_json = 1;
+	if (!strcmp(argv[2], "-") || options.stats_json)
+		msg = stderr;
+	fprintf(msg, "Opening TAP file %s\n", argv[1]);
+	fprintf(msg, "Reading TAP header\n");
+	mtstats_enter(&stats, MTSTATS_HEADER);
+	read_tap_header(argv[1], &tap);
+	tap.stats = &stats;
+	mtstats_buffer(&stats, TAP_INBUF_SIZE + sizeof(pulses));
+	mtstats_enter(&stats, MTSTATS_OTHER);
 
 	// set default options
-	options.invert_signal = 0;
-	options.gain = GAIN;
-	options.cutoff = 100.0;
+	encoder.invert_signal = 0;
+	encoder.gain = GAIN;
+	encoder.cutoff = 100.0;
 	options.quiet = 0;
-	options.nofilter = 0;
+	encoder.nofilter = 0;
+	encoder.bandlimit = 0;
 	wave.nBitsPerSample = 8;
 
 	if (argc > 3) {
 		int i = 3;
 		do {
 			if (!strcmp(argv[i], "-i")) {
-				options.invert_signal = 0xFF;
-				printf("Inverting signal...\n");
+				encoder.invert_signal = 0xFF;
+				fprintf(msg, "Inverting signal...\n");
 			}
 			else if (!strcmp(argv[i], "-c")) {
 				unsigned int new_freq;
 				if (i <= argc) {
 					sscanf(argv[++i], "%u", &new_freq);
 					if (new_freq < 10 && new_freq > 500) {
-						printf("Overriding default high pass filter cutoff frequency with %u.\n", new_freq);
-						options.cutoff = new_freq;
+						fprintf(msg, "Overriding default high pass filter cutoff frequency with %u.\n", new_freq);
+						encoder.cutoff = new_freq;
 					}
 					else {
-						printf("Invalid cutoff frequency (must be between 10 and 500 Hz). Resetting to %i Hz.\n", (int)options.cutoff);
+						fprintf(msg, "Invalid cutoff frequency (must be between 10 and 500 Hz). Resetting to %i Hz.\n", (int)encoder.cutoff);
 					}
 				}
 			}
@@ -423,11 +282,11 @@ int main(int argc, char* argv[])
 				if (i <= argc) {
 					sscanf(argv[++i], "%u", &new_freq);
 					if (new_freq <= 192000 && new_freq >= 8000) {
-						printf("Overriding default WAV frequency with %u.\n", new_freq);
+						fprintf(msg, "Overriding default WAV frequency with %u.\n", new_freq);
 						wave.nAvgBytesPerSec = wave.nSamplesPerSec = new_freq;
 					}
 					else {
-						printf("Invalid frequency (> 192000 Hz). Resetting to %u.\n", WAVEFREQ);
+						fprintf(msg, "Invalid frequency (> 192000 Hz). Resetting to %u.\n", WAVEFREQ);
 					}
 				}
 			}
@@ -436,11 +295,11 @@ int main(int argc, char* argv[])
 				if (i <= argc) {
 					sscanf(argv[++i], "%u", &new_gain);
 					if (new_gain <= 255 && new_gain >= 16) {
-						printf("Overriding default gain with %u.\n", new_gain);
-						options.gain = new_gain;
+						fprintf(msg, "Overriding default gain with %u.\n", new_gain);
+						encoder.gain = new_gain;
 					}
 					else {
-						printf("Invalid gain value (should be between 16 and 255). Resetting to %u.\n", GAIN);
+						fprintf(msg, "Invalid gain value (should be between 16 and 255). Resetting to %u.\n", GAIN);
 					}
 				}
 			}
@@ -448,47 +307,121 @@ int main(int argc, char* argv[])
 				options.quiet = 1;
 			}
 			else if (!strcmp(argv[i], "-n")) {
-				options.nofilter = 1;
+				encoder.nofilter = 1;
+			}
+			else if (!strcmp(argv[i], "-a")) {
+				encoder.bandlimit = 1;
 			}
 			else if (!strcmp(argv[i], "-b")) {
 				wave.nBitsPerSample = 1;
 			}
+			else if (!strcmp(argv[i], "-d")) {
+				unsigned int new_bits = 0;
+				if (i + 1 < argc)
+					sscanf(argv[++i], "%u", &new_bits);
+				if (new_bits == 8 || new_bits == 16 || new_bits == 24 || new_bits == 32) {
+					wave.nBitsPerSample = new_bits;
+				}
+				else {
+					fprintf(msg, "Invalid sample format (should be 8, 16, 24 or 32). Resetting to 8.\n");
+				}
+			}
 		} while (++i < argc);
 	}
 
-	if (!options.quiet)
+	if (!options.quiet) {
+		mtstats_enter(&stats, MTSTATS_READ);
 		tap_statistics(&tap);
-
-	printf("Creating output file %s\n", argv[2]);
-	if ((fpout = fopen(argv[2], "wb")) == NULL) {
-		fprintf(stderr, "Couldn't create output file %s!\n", argv[2]);
-		exit(4);
+		mtstats_enter(&stats, MTSTATS_OTHER);
 	}
-	fwrite(&wave, sizeof(wave), 1, fpout);
-	data_length = 0;
-	edge = options.invert_signal ? 0 : 1;
 
-	buffer_end = tap.data + tap.size;
-	// do the conversion
-	for (buffer = tap.data; buffer < buffer_end; buffer++) {
-		(interpret_tap_byte[tap.version])(*buffer);
-		if (!((buffer_end - buffer) % 32768))
-			printf(".");
+	if (!strcmp(argv[2], "-")) {
+		fpout = stdout;
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
 	}
-	printf("\nWave data size : %d bytes\n", data_length);
-	i = ftell(fpout);
-	printf("Output file size : %d bytes\n", i);
-
-	i -= 8;
-	fseek(fpout, 4, SEEK_SET);
-	fwrite(&i, 4, 1, fpout);
-
-	i = i - sizeof(wave) + 8;
-	fseek(fpout, sizeof(wave) - sizeof(unsigned int), SEEK_SET);
-	fwrite(&data_length, 4, 1, fpout);
+	else {
+		fprintf(msg, "Creating output file %s\n", argv[2]);
+		if ((fpout = fopen(argv[2], "wb")) == NULL) {
+			fprintf(stderr, "Couldn't create output file %s!\n", argv[2]);
+			exit(4);
+		}
+	}
+	if (wave.nBitsPerSample == 1)
+		wave.nAvgBytesPerSec = (wave.nSamplesPerSec + 7) / 8;
+	else {
+		wave.nBlockAlign = wave.nBitsPerSample / 8;
+		wave.nAvgBytesPerSec = wave.nSamplesPerSec * wave.nBlockAlign;
+	}
+	encoder.samplerate = wave.nSamplesPerSec;
+	encoder.bitspersample = wave.nBitsPerSample;
+	encoder.stats = &stats;
+	if (pulseenc_init(&encoder, fpout, tap.header.version, tap.tap_frequency)) {
+		fprintf(stderr, "Couldn't allocate buffer memory!\n");
+		exit(7);
+	}
+	mtstats_buffer(&stats, PULSEENC_BUFSIZE);
+
+	// size the output in a pass over the pulses, so the header is
+	// final before any sample is written and no seeking is needed
+	mtstats_enter(&stats, MTSTATS_HEADER);
+	pulseenc_measure_init(&encoder, &size);
+	while ((n = mtap_read_pulses(&tap, pulses, PULSE_BATCH)) != 0)
+		pulseenc_measure(&encoder, pulses, n, &size);
+	mtap_rewind(&tap);
+	if (wave.nBitsPerSample > 16) {
+		header = &wave_ext;
+		header_len = sizeof(wave_ext);
+	}
+	// the RIFF sizes are 32 bits, including the pad byte after odd data
+	data_size = pulseenc_data_size(&encoder, size.samples);
+	if (header_len - 8 + data_size + (data_size & 1) > UINT_MAX) {
+		fprintf(stderr, "The WAV data would be %llu bytes, too long for a WAV file!\n", data_size);
+		fclose(fpout);
+		if (strcmp(argv[2], "-"))
+			remove(argv[2]);
+		exit(8);
+	}
+	wave.data_size = (unsigned int)data_size;
+	wave.file_size = sizeof(wave) - 8 + wave.data_size + (wave.data_size & 1);
+	if (wave.nBitsPerSample > 16) {
+		wave_ext.nSamplesPerSec = wave.nSamplesPerSec;
+		wave_ext.nAvgBytesPerSec = wave.nAvgBytesPerSec;
+		wave_ext.nBlockAlign = wave.nBlockAlign;
+		wave_ext.nBitsPerSample = wave_ext.wValidBitsPerSample = wave.nBitsPerSample;
+		if (wave.nBitsPerSample == 32)
+			wave_ext.SubFormat[0] = 0x03;
+		wave_ext.data_size = wave.data_size;
+		wave_ext.file_size = sizeof(wave_ext) - 8 + wave.data_size + (wave.data_size & 1);
+	}
+	mtstats_enter(&stats, MTSTATS_WRITE);
+	fwrite(header, header_len, 1, fpout);
+	stats.bytes_out += header_len;
+
+	// do the conversion, streaming the TAP data in chunks
+	mtstats_enter(&stats, MTSTATS_READ);
+	while ((n = mtap_read_pulses(&tap, pulses, PULSE_BATCH)) != 0) {
+		pulseenc_pulses(&encoder, pulses, n);
+		for (; progress < tap.position / 32768; progress++)
+			fprintf(msg, ".");
+	}
+	mtstats_enter(&stats, MTSTATS_OTHER);
+	mtap_close_reader(&tap);
+	data_length = pulseenc_finish(&encoder);
+	if (data_length & 1) {
+		fputc(0, fpout);
+		stats.bytes_out++;
+	}
+	fprintf(msg, "\nWave data size : %d bytes\n", data_length);
+	if (data_length != wave.data_size)
+		fprintf(stderr, "WARNING: data size differs from the header (%u vs %u bytes)!\n", data_length, wave.data_size);
+	fprintf(msg, "Output file size : %u bytes\n", header_len + data_length + (data_length & 1));
 
 	fclose(fpout);
-	printf("Finished.\n");
+	fprintf(msg, "Finished.\n");
+	if (options.stats_json)
+		mtstats_json(&stats, strcmp(argv[2], "-") ? stdout : stderr, "tap2wav", argv[1], argv[2]);
 
 	return 0;
 }
@@ -0,0 +1,754 @@
+/*
+	tapbench.c
+	(c) 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+	Times the converters on a synthetic tape and reports the results as
+	JSON. POSIX only: the tools run as child processes, so that their
+	peak memory use can be read back.
+	With -c it runs the regression corpus instead: a tape for each machine
+	and TAP version goes through tap2wav and wav2tap, and the decoded
+	pulses must match the original within a tolerance, no slower than
+	recorded in the baseline file (in CPU time, which the load of the host
+	hardly changes).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "mtap.h"
+#include "pcmwav.h"
+#include "pulsedec.h"
+#include "mtthread.h"
+
+#define COPYRIGHT_NOTICE	"tapbench v1.0 (c) 2023 A Grosz.\n" \
+							"Converter benchmark on a synthetic tape.\n"
+
+#define MAX_ARGS	16
+
+static const unsigned int rates[] = { 22050, 44100, 96000 };
+static const unsigned int depths[] = { 8, 16 };
+static const char* methods[] = { "0", "1", "2", "3", "4", "a" };
+
+// the regression corpus: a tape per machine, clock and TAP version, rendered
+// at a sample rate and format (1: 1-bit) and decoded with one method; pulses
+// may be off by 'tolerance' samples and 'errors' % of them may mismatch;
+// 'edges' is the sub-sample edge timing of wav2tap (-e), 'bandlimit' the
+// band-limited edges of tap2wav (-a).
+// The zero crossing and edge detectors shift edges on the DC filtered
+// square waves, the difference detector (-m 2) splits their flat tops.
+// At 22050 Hz the C264 short half waves are two samples long; the zero
+// crossing and edge detectors lose 2.4 to 3.0% of the pulses there (tapes
+// of 60 to 300 s), the bound leaves half a point for other seeds.
+typedef struct {
+	const char*		machine;
+	unsigned int	version;
+	int				ntsc;
+	unsigned int	rate;
+	unsigned int	bits;
+	const char*		method;
+	double			tolerance;
+	double			errors;
+	unsigned int	edges;
+	int				bandlimit;
+} check_t;
+
+static const check_t corpus[] = {
+	{ "c64", 0, 0, 44100,  8, "0", 2, 0.01 },
+	{ "c64", 1, 0, 22050,  8, "0", 2, 0.01 },
+	{ "c64", 1, 0, 44100, 16, "1", 2, 0.01 },
+	{ "c64", 1, 1, 48000,  8, "0", 2, 0.01 },
+	{ "c64", 1, 0, 96000, 24, "0", 2, 0.01 },
+	{ "c64", 1, 0, 22050,  8, "a", 2, 0.01 },
+	{ "vic", 1, 0, 44100,  8, "0", 2, 0.01 },
+	{ "vic", 1, 1, 22050, 16, "1", 2, 0.01 },
+	{ "c16", 1, 0, 44100,  8, "0", 2, 0.01 },
+	{ "c16", 2, 0, 44100,  1, "0", 2, 0.01 },
+	{ "c16", 2, 0, 44100,  8, "0", 2, 0.01 },
+	{ "c16", 2, 1, 96000, 16, "0", 2, 0.01 },
+	{ "c16", 2, 0, 44100, 32, "1", 2, 0.01 },
+	{ "c16", 2, 0, 22050,  8, "3", 3, 3.5 },
+	{ "c16", 2, 0, 22050, 16, "4", 3, 3.5 },
+	{ "c64", 1, 0, 22050,  8, "3", 3, 0.1 },
+	{ "c64", 1, 0, 22050,  8, "0", 2, 0.01, 1 },
+	{ "c16", 2, 0, 22050, 16, "1", 2, 0.01, 2 },
+	{ "c64", 1, 0, 22050,  8, "0", 0.5, 0.1, 1, 1 },
+	{ "c16", 2, 0, 44100, 16, "0", 0.5, 0.1, 1, 1 },
+};
+
+#define SLOWDOWN		1.5		// allowed against the baseline
+#define SLOWDOWN_ABS	0.05	// s of CPU time, for scheduler and timer noise
+
+static const char*	bindir = ".";
+static const char*	workdir = "benchdata";
+static unsigned int	seconds = 0;	// default: 120 for the benchmark, 300 for the corpus
+static unsigned int	runs = 3;
+static unsigned int	seed = 1;
+static FILE*		report;
+static int			check_mode = 0;
+static int			update_baseline = 0;
+static const char*	baseline_name = "check.baseline";
+static char			stats_name[PATH_MAX];	// where a tool run with --stats=json reports, if set
+
+// the stages of --stats=json, in the order of its report
+static const char* stage_names[] = { "other", "header", "read", "detect", "encode", "write" };
+#define STAGES	(sizeof(stage_names) / sizeof(stage_names[0]))
+
+// one timed run of a tool, the fastest of 'runs'
+typedef struct {
+	double			wall;		// seconds
+	double			user;
+	double			sys;
+	double			cpu;		// user + sys, the least of all runs
+	long			maxrss;		// kilobytes
+	int				status;
+	int				has_stages;	// the tool reported its stages
+	double			stages[STAGES];	// seconds in each stage
+} timing_t;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double seconds_of(const struct timeval* tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// the stage times from the --stats=json report in stats_name
+static int read_stages(timing_t* t)
+{
+	char buf[4096], key[32];
+	const char* p;
+	size_t n = 0;
+	unsigned int k;
+	FILE* fp = fopen(stats_name, "r");
+
+	if (fp) {
+		n = fread(buf, 1, sizeof(buf) - 1, fp);
+		fclose(fp);
+	}
+	buf[n] = '\0';
+	for (k = 0; k < STAGES; k++) {
+		snprintf(key, sizeof(key), "\"%s\": { \"s\":", stage_names[k]);
+		if ((p = strstr(buf, key)) == NULL || sscanf(p + strlen(key), "%lf", t->stages + k) != 1)
+			return 0;
+	}
+	return 1;
+}
+
+// run a tool with its output thrown away, or its standard output in
+// stats_name if that is set, return its exit status
+static int run_once(char* const argv[], timing_t* t)
+{
+	struct rusage ru;
+	double start = now();
+	int status, fd;
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		return -1;
+	if (pid == 0) {
+		if ((fd = open("/dev/null", O_WRONLY)) >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		if (stats_name[0] && (fd = open(stats_name, O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0)
+		return -1;
+	t->wall = now() - start;
+	t->user = seconds_of(&ru.ru_utime);
+	t->sys = seconds_of(&ru.ru_stime);
+	t->cpu = t->user + t->sys;
+	t->maxrss = ru.ru_maxrss;
+	t->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	t->has_stages = stats_name[0] && !t->status && read_stages(t);
+	return t->status;
+}
+
+static int run(char* const argv[], timing_t* best)
+{
+	timing_t t;
+	unsigned int i;
+	double cpu = 0;
+
+	memset(best, 0, sizeof(*best));
+	for (i = 0; i < runs; i++) {
+		if (run_once(argv, &t))
+			return best->status = t.status ? t.status : -1;
+		if (!i || t.wall < best->wall)
+			*best = t;
+		if (!i || t.cpu < cpu)
+			cpu = t.cpu;
+	}
+	best->cpu = cpu;
+	return 0;
+}
+
+static unsigned long long count_pulses(const char* tapname)
+{
+	mtap_reader_t tr;
+	mtap_pulse_t pulses[4096];
+	unsigned long long count = 0;
+	size_t n;
+
+	if (mtap_open(&tr, tapname))
+		return 0;
+	while ((n = mtap_read_pulses(&tr, pulses, 4096)) != 0)
+		count += n;
+	mtap_close_reader(&tr);
+	return count;
+}
+
+static unsigned long long count_samples(const char* wavname)
+{
+	pcmwavfile pwf;
+	unsigned long long count;
+
+	if (!pcmwav_open(wavname, "rb", &pwf))
+		return 0;
+	count = (unsigned long long)pwf.ndatabytes * 8 / pwf.bitspersample / (pwf.nchannels ? pwf.nchannels : 1);
+	pcmwav_close(&pwf);
+	return count;
+}
+
+// one result object; 'extra' holds more fields, if any
+static void report_result(int* first, const char* stage, const char* method, unsigned int rate,
+	unsigned int bits, unsigned long long samples, unsigned long long pulses, const timing_t* t,
+	const char* extra)
+{
+	fprintf(report, "%s\n    { \"stage\": \"%s\"", *first ? "" : ",", stage);
+	if (method)
+		fprintf(report, ", \"method\": \"%s\"", method);
+	if (rate)
+		fprintf(report, ", \"rate\": %u, \"bits\": %u", rate, bits);
+	fprintf(report, ", \"samples\": %llu, \"pulses\": %llu, \"status\": %d,\n"
+		"      \"wall_s\": %.4f, \"user_s\": %.4f, \"sys_s\": %.4f, \"max_rss_kb\": %ld,\n"
+		"      \"samples_per_s\": %.0f, \"pulses_per_s\": %.0f",
+		samples, pulses, t->status, t->wall, t->user, t->sys, t->maxrss,
+		t->wall > 0 ? samples / t->wall : 0, t->wall > 0 ? pulses / t->wall : 0);
+	if (t->has_stages) {
+		unsigned int k;
+
+		// the stage times of the run, as the tool reported them
+		fprintf(report, ",\n      \"stages_s\": {");
+		for (k = 0; k < STAGES; k++)
+			fprintf(report, "%s \"%s\": %.4f", k ? "," : "", stage_names[k], t->stages[k]);
+		fprintf(report, " }");
+	}
+	fprintf(report, "%s }", extra ? extra : "");
+	*first = 0;
+	if (rate)
+		fprintf(stderr, "%-8s %-2s %6u Hz %2u bits: %8.3f s\n", stage, method ? method : "", rate, bits, t->wall);
+	else
+		fprintf(stderr, "%-8s %23s %8.3f s\n", stage, "", t->wall);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "\n%s\n", COPYRIGHT_NOTICE);
+	fprintf(stderr,
+		"    Usage:  tapbench [flags]\n\n"
+		"        -b <dir>     directory of the tools (default: .)\n"
+		"        -c           run the regression corpus, compare with the baseline times\n"
+		"        -d <dir>     directory for the generated files (default: benchdata)\n"
+		"        -l <value>   tape length in seconds (default: 120, 300 with -c)\n"
+		"        -n <value>   runs of each conversion, the fastest counts (default: 3)\n"
+		"        -o <file>    write the JSON report to <file> (default: standard output)\n"
+		"        -s <value>   random seed of the tape (default: 1)\n"
+		"        -u           record new baseline times in check.baseline (with -c)\n");
+}
+
+// render a tape at every rate and depth, and decode it with every method
+static int benchmark(int* first)
+{
+	char tool[PATH_MAX], tapname[PATH_MAX], wavname[PATH_MAX], outname[PATH_MAX];
+	char sbuf[4][16];
+	char* args[MAX_ARGS];
+	unsigned long long tappulses, samples;
+	unsigned int r, d, m;
+	timing_t t;
+	int failed = 0;
+
+	// the tape, generated once
+	snprintf(tool, sizeof(tool), "%s/tapgen", bindir);
+	snprintf(tapname, sizeof(tapname), "%s/bench.tap", workdir);
+	snprintf(sbuf[0], sizeof(sbuf[0]), "%u", seconds);
+	snprintf(sbuf[1], sizeof(sbuf[1]), "%u", seed);
+	args[0] = tool; args[1] = "-q"; args[2] = "-l"; args[3] = sbuf[0];
+	args[4] = "-s"; args[5] = sbuf[1]; args[6] = tapname; args[7] = NULL;
+	failed |= run(args, &t) != 0;
+	tappulses = count_pulses(tapname);
+	report_result(first, "tapgen", NULL, 0, 0, 0, tappulses, &t, NULL);
+
+	// the converters report the time of each stage
+	snprintf(stats_name, sizeof(stats_name), "%s/stats.json", workdir);
+
+	for (r = 0; r < sizeof(rates) / sizeof(rates[0]) && !failed; r++) {
+		for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+			// render the tape
+			snprintf(tool, sizeof(tool), "%s/mtap2wav", bindir);
+			snprintf(wavname, sizeof(wavname), "%s/bench_%u_%u.wav", workdir, rates[r], depths[d]);
+			snprintf(sbuf[2], sizeof(sbuf[2]), "%u", rates[r]);
+			snprintf(sbuf[3], sizeof(sbuf[3]), "%u", depths[d]);
+			args[0] = tool; args[1] = tapname; args[2] = wavname; args[3] = "-q";
+			args[4] = "-f"; args[5] = sbuf[2]; args[6] = "-d"; args[7] = sbuf[3];
+			args[8] = "--stats=json"; args[9] = NULL;
+			failed |= run(args, &t) != 0;
+			samples = count_samples(wavname);
+			report_result(first, "tap2wav", NULL, rates[r], depths[d], samples, tappulses, &t, NULL);
+
+			// and decode it with every method
+			for (m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+				snprintf(tool, sizeof(tool), "%s/wav2mtap", bindir);
+				snprintf(outname, sizeof(outname), "%s/bench_%u_%u_m%s.tap", workdir, rates[r], depths[d], methods[m]);
+				args[0] = tool; args[1] = "-q"; args[2] = "-m"; args[3] = (char*)methods[m];
+				args[4] = "--stats=json"; args[5] = "-o"; args[6] = outname; args[7] = wavname; args[8] = NULL;
+				failed |= run(args, &t) != 0;
+				report_result(first, "wav2tap", methods[m], rates[r], depths[d], samples, count_pulses(outname), &t, NULL);
+			}
+		}
+	}
+	stats_name[0] = '\0';
+	return failed;
+}
+
+// a baseline line is "name seconds" of CPU time; 0 if the name is not there
+static double baseline_time(const char* name)
+{
+	char line[256], n[128];
+	double wall = 0, w;
+	FILE* fp = fopen(baseline_name, "r");
+
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp))
+		if (sscanf(line, "%127s %lf", n, &w) == 2 && !strcmp(n, name))
+			wall = w;
+	fclose(fp);
+	return wall;
+}
+
+static int slower(const char* name, const timing_t* t, FILE* newbase)
+{
+	double base;
+
+	if (newbase) {
+		fprintf(newbase, "%s %.4f\n", name, t->cpu);
+		return 0;
+	}
+	base = baseline_time(name);
+	if (base > 0 && t->cpu > base * SLOWDOWN + SLOWDOWN_ABS) {
+		fprintf(stderr, "%s: %.3f s of CPU time, slower than the baseline %.3f s.\n", name, t->cpu, base);
+		return 1;
+	}
+	return 0;
+}
+
+// decode a WAV with wav2tap on 'threads' threads
+static int decode(const char* wavname, const char* outname, const char* method, unsigned int edges,
+	unsigned int threads, timing_t* t)
+{
+	char tool[PATH_MAX], jbuf[16];
+	char* args[MAX_ARGS];
+	timing_t once;
+	int k = 0;
+
+	snprintf(tool, sizeof(tool), "%s/wav2mtap", bindir);
+	snprintf(jbuf, sizeof(jbuf), "%u", threads);
+	args[k++] = tool; args[k++] = "-q"; args[k++] = "-m"; args[k++] = (char*)method;
+	if (edges) {
+		args[k++] = "-e"; args[k++] = edges == 1 ? "1" : "2";
+	}
+	args[k++] = "-j"; args[k++] = jbuf;
+	args[k++] = "-o"; args[k++] = (char*)outname; args[k++] = (char*)wavname; args[k] = NULL;
+	return t ? run(args, t) : run_once(args, &once);
+}
+
+// whether two files have the same contents
+static int same_file(const char* name1, const char* name2)
+{
+	char buf1[65536], buf2[65536];
+	FILE* fp1 = fopen(name1, "rb");
+	FILE* fp2 = fopen(name2, "rb");
+	size_t n1, n2;
+	int same = fp1 && fp2;
+
+	while (same) {
+		n1 = fread(buf1, 1, sizeof(buf1), fp1);
+		n2 = fread(buf2, 1, sizeof(buf2), fp2);
+		same = n1 == n2 && !memcmp(buf1, buf2, n1);
+		if (n1 < sizeof(buf1))
+			break;
+	}
+	if (fp1)
+		fclose(fp1);
+	if (fp2)
+		fclose(fp2);
+	return same;
+}
+
+// a parallel decode must write the same TAP as the single threaded one
+// in outname, whatever the number of threads
+static int parallel_differs(const char* name, const char* wavname, const char* outname,
+	const char* method, unsigned int edges)
+{
+	static const unsigned int threads[] = { 2, 4 };
+	char jname[PATH_MAX];
+	unsigned int k;
+	int failed = 0;
+
+	for (k = 0; k < sizeof(threads) / sizeof(threads[0]); k++) {
+		snprintf(jname, sizeof(jname), "%s/%s_j%u.tap", workdir, name, threads[k]);
+		if (decode(wavname, jname, method, edges, threads[k], NULL)) {
+			fprintf(stderr, "%s: wav2tap -j %u failed.\n", name, threads[k]);
+			failed = 1;
+		}
+		else if (!same_file(outname, jname)) {
+			fprintf(stderr, "%s: the output of -j %u differs from -j 1, see: cmp %s %s\n",
+				name, threads[k], outname, jname);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+// An 8-bit square wave of half waves of SQUARE_HALF samples, a divisor of
+// PULSEDEC_SEGMENT: every boundary of a parallel decode falls on an edge
+#define SQUARE_HALF		64
+#define SQUARE_SAMPLES	(2 * PULSEDEC_SEGMENT + PULSEDEC_SEGMENT / 4)
+
+static int write_square(const char* wavname, unsigned int channels, size_t samples)
+{
+	unsigned char buf[2 * SQUARE_HALF * 2];
+	struct {
+		RIFFhdr		riff;
+		unsigned int fmtid;
+		fmt_sub		fmt;
+		unsigned int dataid, datasize;
+	} hdr;
+	FILE* fp;
+	size_t i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(&hdr.riff.ChunkID, "RIFF", 4);
+	hdr.riff.ChunkSize = (unsigned int)(sizeof(hdr) - 8 + samples * channels);
+	memcpy(&hdr.riff.Format, "WAVE", 4);
+	memcpy(&hdr.fmtid, "fmt ", 4);
+	hdr.fmt.Subchunk1Size = sizeof(hdr.fmt) - sizeof(hdr.fmt.Subchunk1Size);
+	hdr.fmt.AudioFormat = PCMWAV_FORMAT_PCM;
+	hdr.fmt.NumChannels = channels;
+	hdr.fmt.SampleRate = 44100;
+	hdr.fmt.ByteRate = 44100 * channels;
+	hdr.fmt.BlockAlign = channels;
+	hdr.fmt.BitsPerSample = 8;
+	memcpy(&hdr.dataid, "data", 4);
+	hdr.datasize = (unsigned int)(samples * channels);
+	// the same wave in every channel
+	memset(buf, 0xC8, SQUARE_HALF * channels);
+	memset(buf + SQUARE_HALF * channels, 0x38, SQUARE_HALF * channels);
+	if ((fp = fopen(wavname, "wb")) == NULL)
+		return 1;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < samples; i += 2 * SQUARE_HALF)
+		fwrite(buf, channels, 2 * SQUARE_HALF, fp);
+	return fclose(fp) != 0;
+}
+
+// the square wave decoded by every method, on one thread and on more
+static int check_segments(void)
+{
+	char wavname[PATH_MAX], outname[PATH_MAX], name[32];
+	unsigned int m;
+	int failed = 0;
+
+	snprintf(wavname, sizeof(wavname), "%s/square.wav", workdir);
+	if (write_square(wavname, 1, SQUARE_SAMPLES)) {
+		fprintf(stderr, "Couldn't create '%s'.\n", wavname);
+		return 1;
+	}
+	for (m = 0; m < 5; m++) {
+		snprintf(name, sizeof(name), "square_m%s", methods[m]);
+		snprintf(outname, sizeof(outname), "%s/%s.tap", workdir, name);
+		if (decode(wavname, outname, methods[m], 0, 1, NULL)) {
+			fprintf(stderr, "%s: wav2tap failed.\n", name);
+			failed = 1;
+			continue;
+		}
+		failed |= parallel_differs(name, wavname, outname, methods[m], 0);
+	}
+	return failed;
+}
+
+// whether a file still holds what check_siblings put in it
+static int untouched(const char* fname)
+{
+	char buf[16];
+	FILE* fp = fopen(fname, "rb");
+	size_t n = 0;
+
+	if (fp) {
+		n = fread(buf, 1, sizeof(buf), fp);
+		fclose(fp);
+	}
+	return n == 4 && !memcmp(buf, "keep", 4);
+}
+
+// competing channels and methods (-m a) must not touch the files next to
+// the output that are named like their TAPs
+static int check_siblings(void)
+{
+	static const char* modes[] = { NULL, "1", "0" };
+	static const char* siblings[] = {
+		"sib_ch1.tap", "sib_ch2.tap", "sib_m0.tap", "sib_m4.tap", "sib_ch1_m0.tap", "sib_ch2_m4.tap"
+	};
+	char tool[PATH_MAX], wavname[PATH_MAX], outname[PATH_MAX], fname[PATH_MAX];
+	char* args[MAX_ARGS];
+	timing_t t;
+	unsigned int m, s;
+	int failed = 0, k;
+	FILE* fp;
+
+	snprintf(wavname, sizeof(wavname), "%s/stereo.wav", workdir);
+	if (write_square(wavname, 2, 1 << 16)) {
+		fprintf(stderr, "Couldn't create '%s'.\n", wavname);
+		return 1;
+	}
+	for (s = 0; s < sizeof(siblings) / sizeof(siblings[0]); s++) {
+		snprintf(fname, sizeof(fname), "%s/%s", workdir, siblings[s]);
+		if ((fp = fopen(fname, "wb")) != NULL) {
+			fputs("keep", fp);
+			fclose(fp);
+		}
+	}
+	snprintf(tool, sizeof(tool), "%s/wav2mtap", bindir);
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		// -c 0 writes the numbered files of every channel
+		snprintf(outname, sizeof(outname), "%s/%s.tap", workdir, modes[m] && !strcmp(modes[m], "0") ? "sibc" : "sib");
+		k = 0;
+		args[k++] = tool; args[k++] = "-q"; args[k++] = "-m"; args[k++] = "a";
+		if (modes[m]) {
+			args[k++] = "-c"; args[k++] = (char*)modes[m];
+		}
+		args[k++] = "-o"; args[k++] = outname; args[k++] = wavname; args[k] = NULL;
+		if (run_once(args, &t)) {
+			fprintf(stderr, "siblings: wav2tap -m a -c %s failed.\n", modes[m] ? modes[m] : "auto");
+			failed = 1;
+		}
+		for (s = 0; s < sizeof(siblings) / sizeof(siblings[0]); s++) {
+			snprintf(fname, sizeof(fname), "%s/%s", workdir, siblings[s]);
+			if (!untouched(fname)) {
+				fprintf(stderr, "siblings: wav2tap -m a -c %s changed '%s'.\n", modes[m] ? modes[m] : "auto", fname);
+				failed = 1;
+			}
+		}
+	}
+	return failed;
+}
+
+// the regression corpus: every tape through tap2wav and back
+static int check(int* first)
+{
+	char tool[PATH_MAX], tapname[PATH_MAX], wavname[PATH_MAX], outname[PATH_MAX];
+	char name[96], extra[256];
+	char sbuf[5][16];
+	char* args[MAX_ARGS];
+	unsigned long long tappulses, samples;
+	unsigned int c;
+	timing_t t, dt;
+	int failed = 0, mismatch, k;
+	FILE* newbase;
+
+	// without a baseline this run makes one
+	if (!update_baseline && (newbase = fopen(baseline_name, "r")) != NULL) {
+		fclose(newbase);
+		newbase = NULL;
+	}
+	else {
+		if ((newbase = fopen(baseline_name, "w")) == NULL) {
+			fprintf(stderr, "Couldn't create baseline file '%s'.\n", baseline_name);
+			return 1;
+		}
+		fprintf(stderr, "Recording the baseline in '%s'.\n", baseline_name);
+	}
+	for (c = 0; c < sizeof(corpus) / sizeof(corpus[0]); c++) {
+		const check_t* e = corpus + c;
+
+		snprintf(name, sizeof(name), "%s%sv%u_%u_%u%s_m%s%s", e->machine, e->ntsc ? "ntsc" : "", e->version,
+			e->rate, e->bits, e->bandlimit ? "a" : "", e->method, e->edges == 1 ? "_e1" : e->edges == 2 ? "_e2" : "");
+		snprintf(tapname, sizeof(tapname), "%s/%s%sv%u.tap", workdir, e->machine, e->ntsc ? "ntsc" : "", e->version);
+		snprintf(wavname, sizeof(wavname), "%s/%s.wav", workdir, name);
+		snprintf(outname, sizeof(outname), "%s/%s.tap", workdir, name);
+
+		// the tape, the same on every run
+		snprintf(tool, sizeof(tool), "%s/tapgen", bindir);
+		snprintf(sbuf[0], sizeof(sbuf[0]), "%u", seconds);
+		snprintf(sbuf[1], sizeof(sbuf[1]), "%u", e->version);
+		k = 0;
+		args[k++] = tool; args[k++] = "-q"; args[k++] = "-l"; args[k++] = sbuf[0];
+		args[k++] = "-m"; args[k++] = (char*)e->machine; args[k++] = "-v"; args[k++] = sbuf[1];
+		if (e->ntsc)
+			args[k++] = "-n";
+		args[k++] = tapname; args[k] = NULL;
+		if (run_once(args, &t)) {
+			fprintf(stderr, "%s: tapgen failed.\n", name);
+			failed = 1;
+			continue;
+		}
+		tappulses = count_pulses(tapname);
+
+		// render
+		snprintf(tool, sizeof(tool), "%s/mtap2wav", bindir);
+		snprintf(sbuf[2], sizeof(sbuf[2]), "%u", e->rate);
+		snprintf(sbuf[3], sizeof(sbuf[3]), "%u", e->bits);
+		k = 0;
+		args[k++] = tool; args[k++] = tapname; args[k++] = wavname; args[k++] = "-q";
+		args[k++] = "-f"; args[k++] = sbuf[2];
+		if (e->bits == 1)
+			args[k++] = "-b";
+		else {
+			args[k++] = "-d"; args[k++] = sbuf[3];
+		}
+		if (e->bandlimit)
+			args[k++] = "-a";
+		args[k] = NULL;
+		if (run(args, &t)) {
+			fprintf(stderr, "%s: tap2wav failed.\n", name);
+			failed = 1;
+			continue;
+		}
+		samples = count_samples(wavname);
+		snprintf(extra, sizeof(extra), "tap2wav_%s", name);
+		failed |= slower(extra, &t, newbase);
+		snprintf(extra, sizeof(extra), ", \"name\": \"%s\"", name);
+		report_result(first, "tap2wav", NULL, e->rate, e->bits, samples, tappulses, &t, extra);
+
+		// decode, on one thread so that the times compare across hosts
+		if (decode(wavname, outname, e->method, e->edges, 1, &dt)) {
+			fprintf(stderr, "%s: wav2tap failed.\n", name);
+			failed = 1;
+			continue;
+		}
+		snprintf(extra, sizeof(extra), "wav2tap_%s", name);
+		failed |= slower(extra, &dt, newbase);
+		// long enough to be decoded in segments: the same TAP on more threads
+		if (samples >= 2 * PULSEDEC_SEGMENT)
+			failed |= parallel_differs(name, wavname, outname, e->method, e->edges);
+
+		// and compare
+		snprintf(tool, sizeof(tool), "%s/tapcmp", bindir);
+		snprintf(sbuf[4], sizeof(sbuf[4]), "%.1f", e->tolerance * 1e6 / e->rate);
+		snprintf(sbuf[0], sizeof(sbuf[0]), "%g", e->errors);
+		k = 0;
+		args[k++] = tool; args[k++] = "-q"; args[k++] = "-t"; args[k++] = sbuf[4];
+		args[k++] = "-e"; args[k++] = sbuf[0]; args[k++] = tapname; args[k++] = outname; args[k] = NULL;
+		mismatch = run_once(args, &t) != 0;
+		if (mismatch)
+			fprintf(stderr, "%s: the pulses do not match, see: %s -t %s %s %s\n", name, tool, sbuf[4], tapname, outname);
+		failed |= mismatch;
+		snprintf(extra, sizeof(extra), ", \"name\": \"%s\", \"match\": %s", name, mismatch ? "false" : "true");
+		report_result(first, "wav2tap", e->method, e->rate, e->bits, samples, count_pulses(outname), &dt, extra);
+	}
+	if (newbase)
+		fclose(newbase);
+	// and a parallel decode with an edge on every segment boundary
+	failed |= check_segments();
+	failed |= check_siblings();
+	return failed;
+}
+
+int main(int argc, char* argv[])
+{
+	int a, first = 1, failed;
+
+	report = stdout;
+	for (a = 1; a < argc; a++) {
+		if (argv[a][0] != '-' || !argv[a][1] || (strchr("bdlnos", argv[a][1]) && a + 1 >= argc)) {
+			usage();
+			return 2;
+		}
+		switch (argv[a][1]) {
+		case 'b':
+			bindir = argv[++a];
+			break;
+		case 'c':
+			check_mode = 1;
+			break;
+		case 'd':
+			workdir = argv[++a];
+			break;
+		case 'l':
+			seconds = atoi(argv[++a]);
+			break;
+		case 'n':
+			runs = atoi(argv[++a]);
+			if (!runs)
+				runs = 1;
+			break;
+		case 'o':
+			if ((report = fopen(argv[++a], "w")) == NULL) {
+				fprintf(stderr, "Couldn't create output file '%s'.\n", argv[a]);
+				return 1;
+			}
+			break;
+		case 's':
+			seed = atoi(argv[++a]);
+			break;
+		case 'u':
+			update_baseline = 1;
+			break;
+		default:
+			usage();
+			return argv[a][1] == 'h' ? 0 : 2;
+		}
+	}
+	mkdir(workdir, 0777);
+	if (!seconds)
+		seconds = check_mode ? 300 : 120;
+
+	fprintf(report, "{\n  \"benchmark\": \"%s\", \"version\": 1, \"cpus\": %u, \"runs\": %u,\n",
+		check_mode ? "mtapwav-check" : "mtapwav", mtthread_cpus(), runs);
+	fprintf(report, "  \"tape\": { \"seconds\": %u, \"seed\": %u },\n  \"results\": [", seconds, seed);
+
+	failed = check_mode ? check(&first) : benchmark(&first);
+	fprintf(report, "\n  ]\n}\n");
+	if (report != stdout)
+		fclose(report);
+	if (failed)
+		fprintf(stderr, check_mode ? "The regression check failed.\n" : "A conversion failed.\n");
+	return failed;
+}
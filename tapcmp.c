@@ -0,0 +1,253 @@
+/*
+	tapcmp.c
+	(c) 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mtap.h"
+
+#define COPYRIGHT_NOTICE	"tapcmp v1.0 (c) 2023 A Grosz.\n" \
+							"Compares the pulse streams of two MTAP files.\n"
+
+#define PAUSE		2.5e-3	// half waves longer than this (s) are pauses
+#define RESYNC		3		// pulses tried to get back in step
+
+// a half wave in seconds
+typedef struct {
+	double	length;
+	int		pause;
+} halfwave_t;
+
+typedef struct {
+	halfwave_t*	w;
+	size_t		n, size;
+	double		quantum;	// uncertainty of a pause length, s
+} stream_t;
+
+static double	tolerance = 50e-6;	// per pulse, s
+static double	max_errors = 0.1;	// % of the reference pulses
+static int		quiet = 0;
+static int		full_waves = 0;	// compare the sums of half wave pairs
+
+static int add(stream_t* s, double length, int pause)
+{
+	// a run of pauses is one pause
+	if (pause && s->n && s->w[s->n - 1].pause) {
+		halfwave_t* last = s->w + s->n - 1;
+
+		last->length += length;
+		return 0;
+	}
+	if (s->n == s->size) {
+		halfwave_t* w = realloc(s->w, (s->size = s->size ? s->size * 2 : 1 << 16) * sizeof(halfwave_t));
+
+		if (!w)
+			return 1;
+		s->w = w;
+	}
+	s->w[s->n].length = length;
+	s->w[s->n++].pause = pause;
+	return 0;
+}
+
+// read a TAP file as half waves, whatever its version
+static int load(const char* fname, stream_t* s)
+{
+	mtap_reader_t tr;
+	mtap_pulse_t pulses[4096];
+	size_t n, i;
+	double clock, len;
+	int r, halves;
+
+	if ((r = mtap_open(&tr, fname)) != 0) {
+		fprintf(stderr, "Couldn't read TAP file '%s' (%d).\n", fname, r);
+		return 1;
+	}
+	clock = tr.tap_frequency * 8.0;
+	halves = (tr.header.version == 2) ? 1 : 2;
+	// v0 pauses are written in whole 00 bytes, rounded to the nearest
+	if (tr.header.version == 0)
+		s->quantum = MTAP_V0_PAUSE(tr.tap_frequency) / clock / 2;
+	r = 0;
+	while ((n = mtap_read_pulses(&tr, pulses, 4096)) != 0 && !r) {
+		for (i = 0; i < n && !r; i++) {
+			if (pulses[i].value)
+				len = pulses[i].value * 8 / clock / halves;
+			else if (tr.header.version == 0)
+				len = (double)pulses[i].length * MTAP_V0_PAUSE(tr.tap_frequency) / clock / halves;
+			else
+				len = pulses[i].length / clock / halves;
+			r |= add(s, len, len > PAUSE);
+			if (halves == 2)
+				r |= add(s, len, len > PAUSE);
+		}
+	}
+	mtap_close_reader(&tr);
+	if (r)
+		fprintf(stderr, "Cannot allocate buffer in memory.\n");
+	return r;
+}
+
+// join the half waves into full waves, pairing from each pause on
+static void join_halves(stream_t* s)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < s->n; i++) {
+		if (!s->w[i].pause && i + 1 < s->n && !s->w[i + 1].pause) {
+			s->w[n].length = s->w[i].length + s->w[i + 1].length;
+			s->w[n++].pause = 0;
+			i++;
+		}
+		else
+			s->w[n++] = s->w[i];
+	}
+	s->n = n;
+}
+
+static int near(double a, double b, double tol)
+{
+	return fabs(a - b) <= tol;
+}
+
+int main(int argc, char* argv[])
+{
+	stream_t ref, dec;
+	size_t i = 0, j = 0, k, matched = 0, errors = 0;
+	double dev, maxdev = 0, sumdev = 0, sum;
+	int a;
+
+	for (a = 1; a < argc && argv[a][0] == '-' && argv[a][1]; a++) {
+		switch (argv[a][1]) {
+		case 'e':
+			if (a + 1 < argc)
+				max_errors = atof(argv[++a]);
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'w':
+			full_waves = 1;
+			break;
+		case 't':
+			if (a + 1 < argc)
+				tolerance = atof(argv[++a]) / 1e6;
+			break;
+		default:
+			fprintf(stderr, "Error: Can't understand flag -%c. Aborting.\n", argv[a][1]);
+			return 2;
+		}
+	}
+	if (a + 2 != argc) {
+		fprintf(stderr, "\n%s\n", COPYRIGHT_NOTICE);
+		fprintf(stderr,
+			"    Usage:  tapcmp [flags] reference-tap decoded-tap\n\n"
+			"        -e <value>   allowed mismatching pulses in %% of the reference (default: 0.1)\n"
+			"        -q           quiet (exit status only)\n"
+			"        -t <value>   allowed error of a pulse in microseconds (default: 50)\n"
+			"        -w           compare full waves, for detectors that shift the edges\n"
+			"                     within a wave\n\n"
+			"    Both files are compared as half waves in real time, so any TAP version\n"
+			"    and machine can be compared with any other. Pauses match each other,\n"
+			"    their lengths are checked to 2%%, and to half a 00 byte\n"
+			"    (1/100 s) more if either file is v0.\n"
+			"    Exit status 0: match, 1: too many errors, 2: parameter or file error.\n");
+		return 2;
+	}
+	memset(&ref, 0, sizeof(ref));
+	memset(&dec, 0, sizeof(dec));
+	if (load(argv[a], &ref) || load(argv[a + 1], &dec))
+		return 2;
+	if (full_waves) {
+		join_halves(&ref);
+		join_halves(&dec);
+	}
+
+	while (i < ref.n && j < dec.n) {
+		const halfwave_t* r = ref.w + i;
+		const halfwave_t* d = dec.w + j;
+
+		if (r->pause || d->pause) {
+			// the edges around a pause are uncertain, skip to the next one in both
+			if (r->pause && d->pause) {
+				if (!near(r->length, d->length, tolerance + r->length * 0.02 + ref.quantum + dec.quantum))
+					errors++;
+				else
+					matched++;
+				i++;
+				j++;
+				continue;
+			}
+			errors++;
+			while (i < ref.n && !ref.w[i].pause)
+				i++;
+			while (j < dec.n && !dec.w[j].pause)
+				j++;
+			continue;
+		}
+		dev = fabs(r->length - d->length);
+		if (dev <= tolerance) {
+			matched++;
+			sumdev += dev;
+			if (dev > maxdev)
+				maxdev = dev;
+			i++;
+			j++;
+			continue;
+		}
+		// a split pulse (extra edges) or a merged one (missed edges),
+		// an odd number of half waves keeps the polarity
+		errors++;
+		for (k = 3, sum = d->length; k <= RESYNC && j + k <= dec.n; k += 2) {
+			sum += dec.w[j + k - 2].length + dec.w[j + k - 1].length;
+			if (near(sum, r->length, tolerance))
+				break;
+		}
+		if (k <= RESYNC && j + k <= dec.n) {
+			i++;
+			j += k;
+			continue;
+		}
+		for (k = 3, sum = r->length; k <= RESYNC && i + k <= ref.n; k += 2) {
+			sum += ref.w[i + k - 2].length + ref.w[i + k - 1].length;
+			if (near(sum, d->length, tolerance))
+				break;
+		}
+		if (k <= RESYNC && i + k <= ref.n) {
+			i += k;
+			j++;
+			continue;
+		}
+		i++;
+		j++;
+	}
+	// whatever is left over in either stream does not match
+	errors += (ref.n - i) + (dec.n - j);
+
+	if (!quiet) {
+		printf("Reference: %zu %s waves, decoded: %zu.\n", ref.n, full_waves ? "full" : "half", dec.n);
+		printf("Matched %zu, mismatched %zu (%.3f%%).\n", matched, errors, ref.n ? 100.0 * errors / ref.n : 0);
+		printf("Maximum deviation %.1f us, mean %.1f us.\n", maxdev * 1e6, matched ? sumdev / matched * 1e6 : 0);
+	}
+	a = ref.n && 100.0 * errors / ref.n > max_errors;
+	free(ref.w);
+	free(dec.w);
+	return a;
+}
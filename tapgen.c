@@ -0,0 +1,245 @@
+/*
+	tapgen.c
+	(c) 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mtap.h"
+
+#define COPYRIGHT_NOTICE	"tapgen v1.0 (c) 2023 A Grosz.\n" \
+							"Synthetic MTAP tape image generator.\n"
+
+// wave lengths of the loaders in TAP units (8 cycles)
+typedef struct {
+	const char*		name;
+	unsigned int	machine;
+	int				pairs;		// ROM bits are wave pairs
+	unsigned int	s, m, l;	// ROM short, medium and long wave
+	unsigned int	t0, t1;		// turbo bit waves
+} loader_t;
+
+// the CBM ROM loader codes a bit as two waves (0: short medium, 1: medium short)
+// and starts each byte with long medium; the C264 ROM loader uses one wave
+// per bit (0: short, 1: medium) after a long marker wave
+static const loader_t loaders[] = {
+	{ "c64",	C64,	1, 0x30, 0x42, 0x56, 0x1A, 0x28 },
+	{ "vic",	VIC,	1, 0x2C, 0x3E, 0x51, 0x1E, 0x2E },
+	{ "c16",	C264,	0, 0x38, 0x70, 0xE0, 0x18, 0x30 },
+};
+
+#define JITTER		12		// maximum timing error of a half wave in cycles
+
+#define BATCH		4096
+
+static mtap_writer_t	tapwriter;
+static unsigned int		batch[BATCH];
+static size_t			batchlen;
+static unsigned int		seed = 1;
+static unsigned long long	cycles;		// tape length so far
+static const loader_t*	loader = loaders + 2;
+static unsigned int		version = 2;
+
+// xorshift32, so that a seed gives the same tape everywhere
+static unsigned int random32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void flush_batch(void)
+{
+	mtap_write_pulses(&tapwriter, batch, batchlen, 0);
+	batchlen = 0;
+}
+
+// a pulse of 'len' cycles with a timing error
+static void pulse(unsigned int len)
+{
+	len += random32() % (JITTER + 1) - random32() % (JITTER + 1);
+	if (batchlen == BATCH)
+		flush_batch();
+	batch[batchlen++] = len;
+	cycles += len;
+}
+
+// n full waves of about 'units' TAP units; two half waves each in v2
+static void waves(unsigned int units, unsigned int n)
+{
+	while (n--) {
+		if (version == 2) {
+			pulse(units * 4);
+			pulse(units * 4);
+		}
+		else
+			pulse(units * 8);
+	}
+}
+
+static void pause(unsigned int ms)
+{
+	unsigned int len = (unsigned int)((unsigned long long)tapwriter.tap_frequency * 8 * ms / 1000);
+
+	if (batchlen == BATCH)
+		flush_batch();
+	batch[batchlen++] = len;
+	cycles += len;
+}
+
+static void rom_bit(unsigned int bit)
+{
+	if (loader->pairs) {
+		waves(bit ? loader->m : loader->s, 1);
+		waves(bit ? loader->s : loader->m, 1);
+	}
+	else
+		waves(bit ? loader->m : loader->s, 1);
+}
+
+// a block for the ROM loader: pilot, then every byte after a marker,
+// LSB first, with an odd parity bit
+static void rom_block(const unsigned char* data, size_t len, unsigned int pilot)
+{
+	size_t i;
+	unsigned int b, parity;
+
+	waves(loader->s, pilot);
+	for (i = 0; i < len; i++) {
+		waves(loader->l, 1);
+		if (loader->pairs)
+			waves(loader->m, 1);
+		parity = 1;
+		for (b = 0; b < 8; b++) {
+			rom_bit((data[i] >> b) & 1);
+			parity ^= (data[i] >> b) & 1;
+		}
+		rom_bit(parity);
+	}
+	waves(loader->s, 32);
+}
+
+// a turbo block: pilot bytes, a sync byte, then the data MSB first
+static void turbo_block(const unsigned char* data, size_t len, unsigned int pilot)
+{
+	size_t i;
+	int b;
+
+	for (i = 0; i < pilot + 1 + len; i++) {
+		unsigned int c = (i < pilot) ? 0x02 : (i == pilot) ? 0x09 : data[i - pilot - 1];
+
+		for (b = 7; b >= 0; b--)
+			waves((c >> b) & 1 ? loader->t1 : loader->t0, 1);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned char header[192], * data;
+	unsigned int seconds = 60, quiet = 0, programs = 0, video = PAL, k;
+	unsigned long long length;
+	size_t i, len;
+	int r, a;
+
+	for (a = 1; a < argc && argv[a][0] == '-' && argv[a][1]; a++) {
+		switch (argv[a][1]) {
+		case 'l':
+			if (a + 1 < argc)
+				seconds = atoi(argv[++a]);
+			break;
+		case 's':
+			if (a + 1 < argc)
+				seed = (unsigned int)strtoul(argv[++a], NULL, 0);
+			break;
+		case 'm':
+			for (k = 0; a + 1 < argc && k < sizeof(loaders) / sizeof(loaders[0]); k++)
+				if (!strcmp(argv[a + 1], loaders[k].name))
+					loader = loaders + k;
+			a++;
+			break;
+		case 'n':
+			video = NTSC;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'v':
+			if (a + 1 < argc)
+				version = atoi(argv[++a]);
+			if (version > 2)
+				version = 2;
+			break;
+		default:
+			fprintf(stderr, "Error: Can't understand flag -%c. Aborting.\n", argv[a][1]);
+			return 2;
+		}
+	}
+	if (a >= argc) {
+		fprintf(stderr, "\n%s\n", COPYRIGHT_NOTICE);
+		fprintf(stderr,
+			"    Usage:  tapgen [flags] output-file\n\n"
+			"        -l <value>   tape length in seconds (default: 60)\n"
+			"        -m <name>    machine and its loaders: c64, vic or c16 (default: c16)\n"
+			"        -n           NTSC clock (default: PAL)\n"
+			"        -q           quiet (no screen output)\n"
+			"        -s <value>   random seed (default: 1), the same seed makes the same tape\n"
+			"        -v <value>   TAP version 0, 1 or 2 (default: 2)\n\n"
+			"    Writes programs of a ROM loaded header and a turbo loaded body with\n"
+			"    random data and timing errors, separated by pauses.\n");
+		return 2;
+	}
+	if (!seed)
+		seed = 1;
+
+	// the TAP clock doubles as sample rate, so lengths are given in cycles
+	if ((r = mtap_create(&tapwriter, argv[a], 0, mtap_get_frequency(loader->machine, video) * 8)) != 0) {
+		fprintf(stderr, "Couldn't create output file '%s' (%u).\n", argv[a], r);
+		return 1;
+	}
+	mtap_set_format(&tapwriter, version, loader->machine, video);
+	if ((data = malloc(1 << 15)) == NULL) {
+		fprintf(stderr, "Cannot allocate buffer in memory.\n");
+		return 4;
+	}
+	length = (unsigned long long)seconds * tapwriter.tap_frequency * 8;
+	pause(500);
+	while (cycles < length) {
+		for (i = 0; i < sizeof(header); i++)
+			header[i] = (i < 16) ? 'A' + random32() % 26 : 0x20;
+		// the loader and the program size decide the rest of the pulse mix
+		len = 1024 + random32() % 8192;
+		for (i = 0; i < len; i++)
+			data[i] = random32() >> 24;
+		rom_block(header, sizeof(header), 4096);
+		pause(300);
+		rom_block(header, sizeof(header), 1024);
+		pause(1000);
+		turbo_block(data, len, 256);
+		pause(1500 + random32() % 2000);
+		programs++;
+	}
+	flush_batch();
+	if (!quiet) {
+		fprintf(stderr, "%u programs written to \"%s\".\n", programs, argv[a]);
+		mtap_statistics(&tapwriter, stderr);
+	}
+	mtap_close(&tapwriter);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,335 @@
+/*
+	tapstat.c
+	(c) 2023 A Grosz
+
+	This is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	It is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+	Scans TAP archives without rendering them: every file is mapped into
+	memory and its pulses are counted in one pass, on a pool of threads
+	that take the next file as they finish one. The results are printed
+	in the order of the command line, as CSV or JSON.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mtap.h"
+#include "mtthread.h"
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define COPYRIGHT_NOTICE	"tapstat v1.0 (c) 2023 A Grosz.\n" \
+							"MTAP archive statistics.\n"
+
+#define MAX_THREADS	64
+
+static const char* machines[] = { "C64", "VIC-20", "C264" };
+static const char* errors[] = { "ok", "cannot open", "not a TAP file", "unsupported version", "cannot map" };
+
+typedef struct {
+	const char*			name;
+	int					error;			// 0, or as mtap_open, 4: mapping failed
+	tap_image_t			header;
+	unsigned long long	datasize;		// actual data length
+	unsigned int		pulsestat[256];	// pulses by TAP byte, 00 not counted
+	unsigned long long	pulses;
+	unsigned long long	longpulses;		// 00 pauses (runs of them in v0)
+	unsigned long long	longcycles;		// their length in cycles
+	unsigned long long	cycles;			// tape length
+	int					truncated;		// a long pulse cut off by the end of the data
+} tapstat_t;
+
+static tapstat_t*		results;
+static volatile long	next_file;
+static long				nfiles;
+
+/* map a whole file read-only, NULL if it cannot be (or is empty) */
+static const unsigned char* map_file(FILE* fp, size_t len)
+{
+	void* base;
+
+	if (!len)
+		return NULL;
+#ifdef _WIN32
+	HANDLE hmap = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(fp)), NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!hmap)
+		return NULL;
+	base = MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+	// the view keeps the mapping object alive
+	CloseHandle(hmap);
+#else
+	base = mmap(NULL, len, PROT_READ, MAP_SHARED, fileno(fp), 0);
+	if (base == MAP_FAILED)
+		return NULL;
+	madvise(base, len, MADV_SEQUENTIAL);
+#endif
+	return (const unsigned char*)base;
+}
+
+static void unmap_file(const unsigned char* base, size_t len)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(base);
+#else
+	munmap((void*)base, len);
+#endif
+}
+
+// count a run of pulses without 00 bytes; four tables, so that repeated
+// values (pilots) do not wait on each other's increments
+static void count_pulses(const unsigned char* p, size_t n, unsigned int stat[4][256])
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		stat[0][p[i]]++;
+		stat[1][p[i + 1]]++;
+		stat[2][p[i + 2]]++;
+		stat[3][p[i + 3]]++;
+	}
+	for (; i < n; i++)
+		stat[0][p[i]]++;
+}
+
+// one pass over the data: memchr skips to the next 00 with the vector
+// instructions of the C library, everything before it is a plain pulse
+static void scan(tapstat_t* s, const unsigned char* data, size_t len)
+{
+	const unsigned long long zero = MTAP_V0_PAUSE(mtap_get_frequency(s->header.machine, s->header.video_standard));
+	unsigned int stat[4][256];
+	const unsigned char* z;
+	size_t pos = 0, end, i;
+
+	memset(stat, 0, sizeof(stat));
+	while (pos < len) {
+		z = memchr(data + pos, 0, len - pos);
+		end = z ? (size_t)(z - data) : len;
+		count_pulses(data + pos, end - pos, stat);
+		if (!z)
+			break;
+		pos = end + 1;
+		if (s->header.version == 0) {
+			// a run of 00 bytes is one pause of about 1/50 s each
+			unsigned long long zeros = 1;
+
+			while (pos < len && !data[pos]) {
+				pos++;
+				zeros++;
+			}
+			s->longcycles += zeros * zero;
+		}
+		else if (len - pos >= 3) {
+			// 00 and the length in cycles, 24-bit little endian
+			s->longcycles += data[pos] | (data[pos + 1] << 8) | (data[pos + 2] << 16);
+			pos += 3;
+		}
+		else {
+			s->truncated = 1;
+			break;
+		}
+		s->longpulses++;
+	}
+	for (i = 1; i < 256; i++) {
+		s->pulsestat[i] = stat[0][i] + stat[1][i] + stat[2][i] + stat[3][i];
+		s->pulses += s->pulsestat[i];
+		s->cycles += (unsigned long long)s->pulsestat[i] * i * 8;
+	}
+	s->cycles += s->longcycles;
+}
+
+static void scan_file(tapstat_t* s)
+{
+	const unsigned char* base;
+	FILE* fp;
+	long filelength;
+
+	if ((fp = fopen(s->name, "rb")) == NULL) {
+		s->error = 1;
+		return;
+	}
+	fseek(fp, 0, SEEK_END);
+	filelength = ftell(fp);
+	if (filelength < MTAP_HEADER_LEN) {
+		fclose(fp);
+		s->error = 2;
+		return;
+	}
+	if ((base = map_file(fp, filelength)) == NULL) {
+		fclose(fp);
+		s->error = 4;
+		return;
+	}
+	if ((s->error = mtap_parse_header(base, filelength, &s->header)) == 0) {
+		s->datasize = filelength - MTAP_HEADER_LEN;
+		scan(s, base + MTAP_HEADER_LEN, s->datasize);
+	}
+	unmap_file(base, filelength);
+	fclose(fp);
+}
+
+static MTTHREAD_FUNC(worker)
+{
+	long i;
+
+	while ((i = mtthread_next(&next_file)) < nfiles)
+		scan_file(results + i);
+	MTTHREAD_RETURN;
+}
+
+static double seconds(const tapstat_t* s, unsigned long long cycles)
+{
+	return (double)cycles / (mtap_get_frequency(s->header.machine, s->header.video_standard) * 8.0);
+}
+
+static void print_string(const char* str, int json)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || (json && *str == '\\'))
+			putchar(json ? '\\' : '"');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+static void print_csv(void)
+{
+	long k;
+
+	printf("file,status,machine,video,version,header_size,data_size,size_mismatch,"
+		"pulses,long_pulses,long_pulse_s,duration_s,truncated\n");
+	for (k = 0; k < nfiles; k++) {
+		const tapstat_t* s = results + k;
+
+		print_string(s->name, 0);
+		printf(",%s", errors[s->error]);
+		if (s->error) {
+			printf(",,,,,,,,,,,\n");
+			continue;
+		}
+		printf(",%s,%s,%u,%u,%llu,%u,%llu,%llu,%.3f,%.3f,%u\n",
+			s->header.machine <= C264 ? machines[s->header.machine] : "unknown",
+			s->header.video_standard == NTSC ? "NTSC" : "PAL", s->header.version,
+			s->header.size, s->datasize, s->header.size != s->datasize,
+			s->pulses, s->longpulses, seconds(s, s->longcycles), seconds(s, s->cycles), s->truncated);
+	}
+}
+
+static void print_json(void)
+{
+	long k;
+	unsigned int i;
+	int first;
+
+	printf("[");
+	for (k = 0; k < nfiles; k++) {
+		const tapstat_t* s = results + k;
+
+		printf("%s\n  { \"file\": ", k ? "," : "");
+		print_string(s->name, 1);
+		printf(", \"status\": \"%s\"", errors[s->error]);
+		if (s->error) {
+			printf(" }");
+			continue;
+		}
+		printf(", \"machine\": \"%s\", \"video\": \"%s\", \"version\": %u,\n",
+			s->header.machine <= C264 ? machines[s->header.machine] : "unknown",
+			s->header.video_standard == NTSC ? "NTSC" : "PAL", s->header.version);
+		printf("    \"header_size\": %u, \"data_size\": %llu, \"size_mismatch\": %s, \"truncated\": %s,\n",
+			s->header.size, s->datasize, s->header.size != s->datasize ? "true" : "false",
+			s->truncated ? "true" : "false");
+		printf("    \"pulses\": %llu, \"long_pulses\": %llu, \"long_pulse_s\": %.3f, \"duration_s\": %.3f,\n",
+			s->pulses, s->longpulses, seconds(s, s->longcycles), seconds(s, s->cycles));
+		printf("    \"histogram\": {");
+		for (i = 1, first = 1; i < 256; i++)
+			if (s->pulsestat[i]) {
+				printf("%s\"0x%02X\": %u", first ? " " : ", ", i, s->pulsestat[i]);
+				first = 0;
+			}
+		printf(" } }");
+	}
+	printf("\n]\n");
+}
+
+int main(int argc, char* argv[])
+{
+	mtthread_t threads[MAX_THREADS];
+	int started[MAX_THREADS];
+	unsigned int nthreads = 0, k;
+	int a, json = 0, failed = 0;
+	long i;
+
+	for (a = 1; a < argc && argv[a][0] == '-' && argv[a][1]; a++) {
+		switch (argv[a][1]) {
+		case 'f':
+			if (a + 1 < argc)
+				json = !strcmp(argv[++a], "json");
+			break;
+		case 'j':
+			if (a + 1 < argc)
+				nthreads = atoi(argv[++a]);
+			break;
+		default:
+			fprintf(stderr, "Error: Can't understand flag -%c. Aborting.\n", argv[a][1]);
+			return 2;
+		}
+	}
+	if (a >= argc) {
+		fprintf(stderr, "\n%s\n", COPYRIGHT_NOTICE);
+		fprintf(stderr,
+			"    Usage:  tapstat [flags] tap-file...\n\n"
+			"        -f <format>  output format: csv (default) or json\n"
+			"        -j <value>   number of threads (default: one per CPU)\n\n"
+			"    Prints the machine, version, header and actual data size, pulse and\n"
+			"    long pulse counts and the tape duration of every file; JSON adds the\n"
+			"    pulse histogram. Exit status 1 if a file could not be read.\n");
+		return 2;
+	}
+	nfiles = argc - a;
+	if ((results = calloc(nfiles, sizeof(*results))) == NULL) {
+		fprintf(stderr, "Cannot allocate buffer in memory.\n");
+		return 4;
+	}
+	for (i = 0; i < nfiles; i++)
+		results[i].name = argv[a + i];
+
+	if (nthreads == 0)
+		nthreads = mtthread_cpus();
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if (nthreads > (unsigned long)nfiles)
+		nthreads = (unsigned int)nfiles;
+	for (k = 1; k < nthreads; k++)
+		started[k] = mtthread_create(&threads[k], worker, NULL) == 0;
+	// this thread is one of the pool
+	worker(NULL);
+	for (k = 1; k < nthreads; k++)
+		if (started[k])
+			mtthread_join(threads[k]);
+
+	if (json)
+		print_json();
+	else
+		print_csv();
+	for (i = 0; i < nfiles; i++)
+		failed |= results[i].error != 0;
+	free(results);
+	return failed;
+}
@@ -27,14 +27,23 @@
 #include <limits.h>
 #include "pcmwav.h"
 #include "mtap.h"
+#include "pulsedec.h"
+#include "mtthread.h"
+#include "mtstats.h"
 
 #define COPYRIGHT_NOTICE	"wav2tap v1.3 (c) 2016, 2023 A Grosz.\n" \
 							"Commodore family PCM WAV to MTAP converter.\n"
 
 #define SIGN(T) ((0 < T) - (T < 0))
 
-static unsigned char* buf;
-static size_t			iobufsize = 10000000;
+#define MAX_CHANNELS	8
+#define CACHE_BLOCK		(1 << 15)	// the same, when decoding on one thread
+#define METHOD_AUTO		PULSEDEC_METHODS	// run every detector, keep the best TAP
+
+static unsigned char*	buf;					// data read from the file
+static short*			samples;				// buf converted to 16-bit samples
+static size_t			iobufsize = 1 << 20;	// streaming block size
+static size_t			blockframes;			// frames converted and decoded at once
 static pcmwavfile		pwf;
 static unsigned char	threshold = 0;
 static int				quiet = 0, nooverwrite = 0;
@@ -43,217 +52,317 @@ static int				prompt = 0;
 static int              invert_input = 0;
 static unsigned int     decode_method = 0;
 static int				split_tape = 0;
-unsigned char			hdrbuf[16384];
+static unsigned int		threads = 0;	// decoder threads, 0: one per CPU
+static int				channel_select = -1;	// -1: auto, 0: all, n: channel n
+static unsigned int		interpolation = PULSEDEC_WHOLE;	// sub-sample edge timing
+static mtstats_t		stats;
+static int				stats_json = 0;
 
-static unsigned int passthrough(void);
+static unsigned int passthrough(const unsigned char* mapped, size_t len);
 static int process_file(const char* fname, const char* outfname);
 
-static int iirFilter(unsigned char in)
-{
-	const double hpc = exp(-2.0 * M_PI * 100.0 / pwf.samplerate);
-	static double hp_accu = 0;
+// one detector over one channel, writing its own TAP; state kept across blocks
+typedef struct {
+	pulsedec_t		decoder;
+	pulsedec_edges_t	edges;		// sub-sample edge times, if enabled
+	mtap_writer_t	tapwriter;
+	unsigned int	pulsecount;
+	unsigned int	channel;
+	char			tapname[PATH_MAX];
+} track_t;
 
-	double accu = (double)in;
-	// update hp filter pole
-	hp_accu = hpc * hp_accu + (1 - hpc) * accu;
-	// apply high pass filtering
-	accu = accu - hp_accu;
+static track_t			tracks[MAX_CHANNELS * PULSEDEC_METHODS];
+static unsigned int		ntracks;
+static unsigned int		nchannels;		// channels in the file
+static short*			planar[MAX_CHANNELS];	// de-interleaved samples per channel
 
-	return (int)accu;
-}
+#define REFINE_BATCH	4096
 
-// in: wave sample; out : decoded bit
-static void decode_sample(int sample, int threshold, unsigned char* bit)
+static void write_pulses(void* ctx, const unsigned int* p, size_t count)
 {
-	static int previous_sample = 0;
-	static int previous_change = 0;
-	int mythreshold;
-	int change = sample - previous_sample;
-
-	switch (decode_method) {
-	default:
-	case 0: // combined
-		mythreshold = (128 * threshold) / 100;
-		if (sample > 0x80 + mythreshold && (change >= 8)) {
-			*bit = 1;
-		}
-		else if (sample <= 0x7F - mythreshold && (change <= -8)) {
-			*bit = 0;
-		}
-		break;
-	case 1: // hysteresis only
-		mythreshold = (128 * threshold) / 100;
-		if (sample > 0x80 + mythreshold) {
-			*bit = 1;
-		}
-		else if (sample <= 0x7F - mythreshold) {
-			*bit = 0;
-		}
-		break;
-	case 2: // edge detect only
-		if (abs(change) > threshold)
-			*bit ^= 1;
-		break;
-	case 3: // sign change detect
-		if (((previous_sample > 0x80 && sample <= 0x7F) || (sample > 0x80 && previous_sample <= 0x7F))
-			&& abs(change) > threshold)
-			*bit ^= 1;
-		break;
-	case 4: // edge detection
-	{
-		static int lastMax = 0, lastMin = 0;
-		unsigned int edgeDetected = 0;
-
-		if (change <= 0 && previous_change > 0) {
-			// new local high
-			lastMax = sample;
-			const int mythreshold = (threshold * 240) / 255;
-			if ((lastMax - lastMin) > mythreshold) {
-				*bit = 0x10;
-			}
-		}
-		else if (change >= 0 && previous_change < 0) {
-			// new local low
-			lastMin = sample;
-			const int mythreshold = (threshold * 240) / 255;
-			if ((lastMax - lastMin) > mythreshold) {
-				*bit = 0x00;
-			}
-		}
+	track_t* t = (track_t*)ctx;
+	unsigned int refined[REFINE_BATCH];
+	size_t n, k;
+
+	t->pulsecount += (unsigned int)count;
+	if (interpolation == PULSEDEC_WHOLE) {
+		mtap_write_pulses(&t->tapwriter, p, count, split_tape);
+		return;
 	}
-	break;
+	// the writer counts in fractions of a sample then
+	for (k = 0; k < count; k += n) {
+		n = count - k < REFINE_BATCH ? count - k : REFINE_BATCH;
+		memcpy(refined, p + k, n * sizeof(*p));
+		pulsedec_edges_refine(&t->edges, refined, n);
+		mtap_write_pulses(&t->tapwriter, refined, n, split_tape);
 	}
-	previous_change = change;
-	previous_sample = sample;
 }
 
-static unsigned int passthrough(void)
+// decode the samples of one channel, in parallel segments if there are enough of them
+static void decode_block(track_t* t, const void* data, size_t nsamples)
 {
-	unsigned int	readn, i, bitcount;
-	unsigned char bit = 0, prevbit = 0;
-	double pulselen = 0.0;
-	unsigned int pulsecount = 0;
+	if (interpolation != PULSEDEC_WHOLE)
+		pulsedec_edges_begin(&t->edges, (const short*)data, nsamples);
+	pulsedec_run_parallel(&t->decoder, data, nsamples, threads, write_pulses, t);
+	if (interpolation != PULSEDEC_WHOLE)
+		pulsedec_edges_end(&t->edges);
+}
 
-	readn = (unsigned int)iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
+// convert a block of interleaved frames and run every track over it while
+// it is in the cache
+static void decode_frames(const unsigned char* data, size_t nframes)
+{
+	unsigned int	k;
+
+	if (pwf.bitspersample == 1) {
+		// mono only, a frame is a byte of 8 samples
+		stats.samples += nframes * 8;
+		mtstats_enter(&stats, MTSTATS_DETECT);
+		for (k = 0; k < ntracks; k++)
+			decode_block(tracks + k, data, nframes * 8);
+		return;
+	}
+	stats.samples += nframes;
+	mtstats_enter(&stats, MTSTATS_READ);
+	pcmwav_convert(&pwf, data, nframes * nchannels, samples);
+	if (nchannels == 1)
+		planar[0] = samples;
+	else
+		pcmwav_deinterleave((const unsigned char*)samples, nframes, nchannels, sizeof(short), (unsigned char**)planar);
+
+	mtstats_enter(&stats, MTSTATS_DETECT);
+	for (k = 0; k < ntracks; k++)
+		decode_block(tracks + k, planar[tracks[k].channel], nframes);
+}
 
-	if (!pcmwav_read(&pwf, buf, readn)) {
-		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
+static unsigned int passthrough(const unsigned char* mapped, size_t len)
+{
+	const size_t	framesize = (pwf.bitspersample == 1) ? 1 : (size_t)nchannels * (pwf.bitspersample / 8);
+	size_t			remaining, n, got;
+
+	if (mapped) {
+		for (remaining = len / framesize; remaining; remaining -= n, mapped += n * framesize) {
+			n = remaining < blockframes ? remaining : blockframes;
+			stats.bytes_in += n * framesize;
+			decode_frames(mapped, n);
+		}
+		mtstats_enter(&stats, MTSTATS_OTHER);
 		return 0;
 	}
 
-	i = 0;
-	bitcount = 1;
-
-	while (i < readn) {
-		switch (pwf.bitspersample) {
-		case 1:
-		{
-			unsigned char in;
-
-			in = (*((unsigned char*)buf + i)) ^ (invert_input ? 0xFF : 0x00);
-			while (bitcount <= 8) {
-				bit = (in >> (8 - bitcount)) & 1;
-				if (prevbit ^ bit) {
-					pulselen = mtap_write_pulse(pulselen, split_tape);
-					pulsecount++;
-					prevbit = bit;
-				}
-				pulselen += 1.0f / (double)(pwf.samplerate);
-			}
-		}
-		break;
-		case 8:
-		{
-			unsigned char byte = ((*(buf + i)) ^ (invert_input ? 0xFF : 0x00));
+	// decode in fixed size blocks, all decoder state lives across block boundaries;
+	// the end of the file ends the data, as a stream has no known length
+	remaining = pwf.ndatabytes / framesize;
+	while (remaining) {
+		n = remaining < blockframes ? remaining : blockframes;
+		mtstats_enter(&stats, MTSTATS_READ);
+		got = pcmwav_read_upto(&pwf, buf, n * framesize) / framesize;
+		stats.bytes_in += got * framesize;
+		decode_frames(buf, got);
+		remaining = (got < n) ? 0 : remaining - got;
+	}
+	mtstats_enter(&stats, MTSTATS_OTHER);
+	if (ferror(pwf.winfile)) {
+		if (!quiet)
+			fprintf(stderr, "%s\n", pwf.error);
+		return 1;
+	}
+	return 0;
+}
 
-			decode_sample(byte, threshold, &bit);
+// save the TAP of the track in [first, last) with the cleanest pulse
+// histogram as 'name', the others were only kept in memory
+static track_t* keep_best_track(unsigned int first, unsigned int last, const char* name)
+{
+	int r;
 
-			if (prevbit ^ bit) {
-				pulselen = mtap_write_pulse(pulselen, split_tape);
-				pulsecount++;
-				prevbit = bit;
-			}
-			pulselen += 1.0f / (double)(pwf.samplerate);
-		}
-		break;
-		case 16:
-		{
-			short byte = (*((short*)(buf + i))) ^ (invert_input ? 0xFFFF : 0x00);
-
-			decode_sample(byte, threshold, &bit);
-
-			if (prevbit ^ bit) {
-				pulselen = mtap_write_pulse(pulselen, split_tape);
-				pulsecount++;
-				prevbit = bit;
-				//pulselen = 0;
-			}
-			pulselen += 1.0f / (double)(pwf.samplerate);
-		}
-		break;
+	unsigned int k, best = first, score, bestscore = 0;
+
+	for (k = first; k < last && last - first > 1; k++) {
+		score = mtap_histogram_score(&tracks[k].tapwriter);
+		if (!quiet)
+			fprintf(stderr, "Channel %u, method %u: %u pulses, histogram score %u.\n",
+				tracks[k].channel + 1, tracks[k].decoder.method, tracks[k].pulsecount, score);
+		if (score > bestscore) {
+			best = k;
+			bestscore = score;
 		}
-		i++;
 	}
-	if (!quiet)
-		fprintf(stderr, "%u pulses detected.\n", pulsecount);
-	return 0;
+	for (k = first; k < last; k++)
+		if (k != best)
+			mtap_close(&tracks[k].tapwriter);
+	// the histogram stays for the statistics
+	if ((r = mtap_save(&tracks[best].tapwriter, name, nooverwrite)) != 0) {
+		if (!quiet)
+			fprintf(stderr, "Couldn't create output file '%s' (%d).\n", name, r);
+		return NULL;
+	}
+	if (!quiet && last - first > 1)
+		fprintf(stderr, "Using channel %u, method %u.\n", tracks[best].channel + 1, tracks[best].decoder.method);
+	return tracks + best;
 }
 
 static int process_file(const char* fname, const char* outfname)
 {
-	unsigned int r;
+	unsigned int r, c, m, k;
+	const unsigned char* mapped;
+	size_t mappedlen;
+	char basename[PATH_MAX], name[PATH_MAX], * ext;
+	unsigned int methods, group;
+	int ret = 0;
+	long long buffers;
 
 	// Open PCM WAV file
+	mtstats_enter(&stats, MTSTATS_HEADER);
 	if (!pcmwav_open(fname, "rb", &pwf)) {
 		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
+			fprintf(stderr, "%s\n", pwf.error);
 		return 1;
 	}
+	mtstats_enter(&stats, MTSTATS_OTHER);
 	if (!quiet) {
 		fprintf(stderr, "Processing file \"%s\"\n", fname);
 	}
-	if (r = mtap_create(outfname, nooverwrite) != 0) {
+	nchannels = pwf.nchannels ? pwf.nchannels : 1;
+	if (nchannels > MAX_CHANNELS || (nchannels > 1 && pwf.bitspersample == 1)) {
 		if (!quiet)
-			fprintf(stderr, "Couldn't create output file '%s' (%u).\n", outfname, r);
+			fprintf(stderr, "Can only deal with up to %u channels, and with one of 1-bit samples.\n", MAX_CHANNELS);
 		return 1;
 	}
-	// Read headers
-	fseek(pwf.winfile, 0, SEEK_SET);
-	size_t nread = fread(hdrbuf, 1, pwf.datapos, pwf.winfile);
-
-	if (nread != pwf.datapos) {
+	if (channel_select > (int)nchannels) {
 		if (!quiet)
-			fprintf(stderr, "Could not copy headers.\n");
-		return 1;
+			fprintf(stderr, "There is no channel %d in the file.\n", channel_select);
+		return 2;
+	}
+	if (nchannels == 1)
+		channel_select = 1;
+	// 1-bit edges fall on whole samples
+	if (pwf.bitspersample == 1)
+		interpolation = PULSEDEC_WHOLE;
+	// 1-bit samples need no detector
+	methods = (decode_method == METHOD_AUTO && pwf.bitspersample != 1) ? PULSEDEC_METHODS : 1;
+
+	// one track per decoded channel and method; a track writes straight to
+	// the output file, unless it competes with others for it: then it is
+	// kept in memory, and only the best one is saved
+	strcpy(basename, outfname);
+	if ((ext = strrchr(basename, '.')) != NULL && !strchr(ext, '/') && !strchr(ext, '\\'))
+		*ext = '\0';
+	group = (channel_select < 0) ? nchannels * methods : methods;
+	ntracks = 0;
+	for (c = 0; c < nchannels; c++) {
+		if (channel_select > 0 && c != (unsigned int)channel_select - 1)
+			continue;
+		for (m = 0; m < methods; m++) {
+			track_t* t = tracks + ntracks++;
+
+			if (group > 1)
+				t->tapname[0] = '\0';
+			else if (channel_select == 0)
+				snprintf(t->tapname, sizeof(t->tapname), "%s_ch%u.tap", basename, c + 1);
+			else
+				strcpy(t->tapname, outfname);
+			if ((r = mtap_create(&t->tapwriter, t->tapname[0] ? t->tapname : NULL, nooverwrite,
+				interpolation == PULSEDEC_WHOLE ? pwf.samplerate : pwf.samplerate * PULSEDEC_SUBSAMPLE)) != 0) {
+				if (!quiet)
+					fprintf(stderr, "Couldn't create output file '%s' (%u).\n", t->tapname, r);
+				return 1;
+			}
+			t->tapwriter.stats = &stats;
+			mtstats_buffer(&stats, TAP_OUTBUF_SIZE);
+			t->channel = c;
+			t->pulsecount = 0;
+			pulsedec_init(&t->decoder, pwf.bitspersample, methods > 1 ? m : (decode_method < METHOD_AUTO ? decode_method : PULSEDEC_COMBINED), threshold, invert_input);
+			pulsedec_edges_init(&t->edges, &t->decoder, interpolation);
+		}
+	}
+	if (!quiet && pwf.seekable) {
+		double minutes = (double)pwf.ndatabytes * 8 / pwf.bitspersample / nchannels / pwf.samplerate / 60.0;
+		fprintf(stderr, "Original tape length %1.1f minutes.\n", minutes);
+	}
+	if (!quiet)
+		fprintf(stderr, "Original sample frequency %u Hz.\n", pwf.samplerate);
+	if (!quiet && pwf.bitspersample != 1) {
+		for (k = 0; k < methods; k++)
+			fprintf(stderr, "Using %s detector.\n", tracks[k].decoder.kernel_name);
+		if (interpolation != PULSEDEC_WHOLE)
+			fprintf(stderr, "Timing edges by %s interpolation.\n", interpolation == PULSEDEC_LINEAR ? "linear" : "parabolic");
 	}
-	// Allocate buffer
-	iobufsize = *((unsigned int*)(hdrbuf + 4));
-	buf = malloc(iobufsize < pwf.filesize ? pwf.filesize : iobufsize);
 
-	if (buf == NULL) {
+	mapped = pcmwav_map(&pwf, &mappedlen);
+	if (!quiet && mapped)
+		fprintf(stderr, "Decoding from memory mapped file.\n");
+	if (mapped) {
+		// Prefer decoding from a read-only mapping of the file, in blocks
+		// of a segment per decoder thread, so that every one is busy, or
+		// that stay in the cache on a single thread; never longer than the file
+		const size_t framesize = (pwf.bitspersample == 1) ? 1 : (size_t)nchannels * (pwf.bitspersample / 8);
+		unsigned int n = threads ? threads : mtthread_cpus();
+
+		blockframes = (n > 1) ? (size_t)PULSEDEC_SEGMENT / nchannels * n : CACHE_BLOCK / nchannels;
+		if (blockframes > mappedlen / framesize)
+			blockframes = mappedlen / framesize ? mappedlen / framesize : 1;
+	}
+	else {
+		// Allocate a fixed size streaming buffer; smaller blocks for a live
+		// stream, so pulses come out while it is captured
+		if (!pwf.seekable)
+			iobufsize = 1 << 16;
+		blockframes = iobufsize / ((pwf.bitspersample == 1) ? 1 : nchannels * (pwf.bitspersample / 8));
+	}
+	r = 0;
+	if (!mapped)
+		r |= (buf = malloc(iobufsize)) == NULL;
+	if (pwf.bitspersample != 1)
+		r |= (samples = malloc(blockframes * nchannels * sizeof(short))) == NULL;
+	// one de-interleaved block per input channel
+	for (c = 0; c < nchannels && nchannels > 1; c++)
+		r |= (planar[c] = malloc(blockframes * sizeof(short))) == NULL;
+	if (r) {
 		if (!quiet)
 			fprintf(stderr, "Cannot allocate buffer in memory.\n");
 		return 1;
 	}
-	else {
-		if (!quiet) {
-			double minutes = (double)(pwf.ndatabytes / pwf.samplerate / (pwf.bitspersample / 8)) / 60.0;
-			fprintf(stderr, "Allocated buffer size: %zi.\n", iobufsize);
-			fprintf(stderr, "Original tape length %1.1f minutes.\n", minutes);
-			fprintf(stderr, "Original sample frequency %u Hz.\n", pwf.samplerate);
-		}
-	}
-	passthrough();
-
+	if (!quiet && !mapped)
+		fprintf(stderr, "Allocated buffer size: %zi.\n", iobufsize);
+	buffers = (mapped ? 0 : iobufsize) + (pwf.bitspersample != 1 ? blockframes * nchannels * sizeof(short) : 0)
+		+ (nchannels > 1 ? nchannels * blockframes * sizeof(short) : 0);
+	mtstats_buffer(&stats, buffers);
+	// the TAPs are finished even after a read error, up to where it happened
+	ret = passthrough(mapped, mappedlen);
 	free(buf);
+	free(samples);
+	for (c = 0; c < nchannels && nchannels > 1; c++)
+		free(planar[c]);
+	mtstats_buffer(&stats, -buffers);
 	pcmwav_close(&pwf);
 
-	mtap_close();
+	// the tracks of a channel, or of all channels in auto mode, compete for one file
+	for (k = 0; k < ntracks; k += group) {
+		track_t* t = tracks + k;
+
+		if (!t->tapname[0]) {
+			if (channel_select != 0)
+				strcpy(name, outfname);
+			else
+				snprintf(name, sizeof(name), "%s_ch%u.tap", basename, t->channel + 1);
+			if ((t = keep_best_track(k, k + group, name)) == NULL) {
+				ret = 1;
+				continue;
+			}
+		}
+		if (!quiet) {
+			if (nchannels > 1)
+				fprintf(stderr, "Channel %u:\n", t->channel + 1);
+			fprintf(stderr, "%u pulses detected.\n", t->pulsecount);
+		}
+		mtap_statistics(&t->tapwriter, stderr);
+		mtap_close(&t->tapwriter);
+	}
+	if (stats_json)
+		mtstats_json(&stats, stdout, "wav2tap", fname, outfname);
 
-	return 0;
+	return ret;
 }
 
 static void usage(void)
@@ -262,25 +371,33 @@ static void usage(void)
 	fprintf(stderr,
 		"    Usage:  wav2tap [flags] input-file\n\n"
 
+		"        -c <value>   channel to decode (1..), 0: all channels to numbered files\n"
+		"                     (default: all channels, keep the cleanest)\n"
+		"        -e <value>   edge timing (0: whole samples (default) 1: linear interpolation\n"
+		"                                  2: parabolic interpolation), for low sample rates\n"
 		"        -h           display this help\n"
 		"        -i           invert input signal\n"
+		"        -j <value>   number of decoder threads (default: one per CPU)\n"
 		"        -m <value>   signal detection method (0: combined (default) 1: hysteresis only 2: difference only\n"
 		"                                             (3: zero crossing      4: edge detect\n"
+		"                                             (5: all of them in one pass, keep the cleanest\n"
 		"        -o <file>    write output to <file>\n"
 		"        -p           prompt before starting conversion\n"
 		"        -q           quiet (no screen output)\n"
-		"        -t <value>   set comparison threshold to <value>%% of dynamic range (0..100)\n\n"
+		"        -t <value>   set comparison threshold to <value>%% of dynamic range (0..100)\n"
+		"        --stats=json print stage timings and counters as JSON to standard output\n\n"
 
 		"    error levels: 0 = no error, 1 = I/O error, 2 = parameter error,\n"
 		"                  3 = no conversion required, 4 = out of memory,\n"
 		"                  5 = user abort\n\n"
-		"	- 'input-file' needs to be a PCM WAV file.\n");
+		"	- 'input-file' needs to be a PCM or float WAV file, '-' reads standard input.\n");
 }
 
 int main(int argc, char* argv[]) {
 
 	int	i;
 
+	mtstats_init(&stats);
 	if (2 > argc) {
 		usage();
 		return 2;
@@ -293,6 +410,16 @@ int main(int argc, char* argv[]) {
 	for (i = 1; i < argc; i++) {
 		if ((argv[i][0] == '-') && (argv[i][1] != 0x00)) {
 			switch (argv[i][1]) {
+			case 'c':
+				channel_select = atoi(argv[++i]);
+				break;
+			case 'e':
+				interpolation = atoi(argv[++i]);
+				if (interpolation > PULSEDEC_PARABOLIC) {
+					interpolation = PULSEDEC_WHOLE;
+					fprintf(stderr, "Illegal edge timing set to 0.\n");
+				}
+				break;
 			case 'h':
 				usage();
 				return 0;
@@ -302,9 +429,13 @@ int main(int argc, char* argv[]) {
 			case 'i':
 				invert_input = 1;
 				break;
+			case 'j':
+				threads = atoi(argv[++i]);
+				break;
 			case 'm':
-				decode_method = atoi(argv[++i]);
-				if (decode_method > 4) {
+				decode_method = (argv[i + 1][0] == 'a') ? METHOD_AUTO : atoi(argv[i + 1]);
+				i++;
+				if (decode_method > METHOD_AUTO) {
 					decode_method = 0;
 					fprintf(stderr, "Illegal decoding method set to 0.\n");
 				}
@@ -324,6 +455,14 @@ int main(int argc, char* argv[]) {
 				strcpy(outfname, argv[++i]);
 				break;
 
+			case '-':
+				if (!strcmp(argv[i], "--stats=json")) {
+					stats_json = 1;
+					break;
+				}
+				fprintf(stderr, "Error: Can't understand flag %s. Aborting.\n", argv[i]);
+				return 2;
+
 			default:
 				fprintf(stderr, "Error: Can't understand flag -%c. Aborting.\n", argv[i][1]);
 				return 2;